@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Atomic primitive benchmarks
+ *
+ * Every primitive family of asm/arm64/atomic.h is measured with each
+ * ordering variant, under three kinds of contention:
+ *
+ * none:   every thread owns a cache line
+ * shared: all threads hit the same word
+ * false:  every thread owns a word, but they share a cache line
+ *
+ * The order of xchg and cmpxchg is log2 of the operand size in bytes.
+ * The plain and no-prefetch variants are the baselines, for the relaxed
+ * ordering and the "prfm pstl1strm" ahead of the exclusive loops.
+ */
+
+#include <mbox/atomic.h>
+#include "bench.h"
+
+#define ATOMIC_BENCH_WORDS	(SMP_CACHE_BYTES / sizeof(u64))
+
+enum atomic_bench_mode {
+	ATOMIC_BENCH_NONE,
+	ATOMIC_BENCH_SHARED,
+	ATOMIC_BENCH_FALSE,
+};
+
+struct atomic_bench_line {
+	u64		words[ATOMIC_BENCH_WORDS];
+} ____cacheline_aligned;
+
+static struct atomic_bench_line *atomic_bench_lines;
+
+static int atomic_bench_setup(struct bench_ctx *ctx)
+{
+	size_t size = ctx->threads * sizeof(*atomic_bench_lines);
+
+	if (posix_memalign((void **)&atomic_bench_lines, SMP_CACHE_BYTES, size))
+		return -ENOMEM;
+
+	memset(atomic_bench_lines, 0, size);
+	return 0;
+}
+
+static void atomic_bench_teardown(struct bench_ctx *ctx)
+{
+	free(atomic_bench_lines);
+	atomic_bench_lines = NULL;
+}
+
+static void *atomic_bench_ptr(struct bench_thread *thread,
+			      enum atomic_bench_mode mode)
+{
+	switch (mode) {
+	case ATOMIC_BENCH_SHARED:
+		return &atomic_bench_lines[0].words[0];
+	case ATOMIC_BENCH_FALSE:
+		return &atomic_bench_lines[0].words[thread->id %
+						    ATOMIC_BENCH_WORDS];
+	default:
+		return &atomic_bench_lines[thread->id].words[0];
+	}
+}
+
+static __always_inline void plain_op(void *ptr, unsigned long i)
+{
+	u64 *p = ptr;
+
+	WRITE_ONCE(*p, READ_ONCE(*p) + 1);
+}
+
+static __always_inline void add_op(void *ptr, unsigned long i)
+{
+	arch_atomic64_add(ptr, 1);
+}
+
+#define ATOMIC_BENCH_RETURN(name, sfx)					\
+static __always_inline void name##_op(void *ptr, unsigned long i)	\
+{									\
+	arch_atomic64_add_return##sfx(ptr, 1);				\
+}
+
+ATOMIC_BENCH_RETURN(add_return_relaxed, _relaxed)
+ATOMIC_BENCH_RETURN(add_return_acquire, _acquire)
+ATOMIC_BENCH_RETURN(add_return_release, _release)
+ATOMIC_BENCH_RETURN(add_return_mb, )
+
+#define ATOMIC_BENCH_XCHG(name, sfx)					\
+static __always_inline void name##_op(void *ptr, unsigned long i,	\
+				      unsigned int order)		\
+{									\
+	switch (order) {						\
+	case 0:								\
+		arch_xchg##sfx((u8 *)ptr, (u8)i);			\
+		break;							\
+	case 1:								\
+		arch_xchg##sfx((u16 *)ptr, (u16)i);			\
+		break;							\
+	case 2:								\
+		arch_xchg##sfx((u32 *)ptr, (u32)i);			\
+		break;							\
+	default:							\
+		arch_xchg##sfx((u64 *)ptr, (u64)i);			\
+	}								\
+}
+
+ATOMIC_BENCH_XCHG(xchg_relaxed, _relaxed)
+ATOMIC_BENCH_XCHG(xchg_acquire, _acquire)
+ATOMIC_BENCH_XCHG(xchg_release, _release)
+ATOMIC_BENCH_XCHG(xchg_mb, )
+
+/* A single attempt, which fails when another thread gets in between */
+#define ATOMIC_BENCH_CMPXCHG(name, sfx)					\
+static __always_inline void name##_op(void *ptr, unsigned long i,	\
+				      unsigned int order)		\
+{									\
+	switch (order) {						\
+	case 0:								\
+		arch_cmpxchg##sfx((u8 *)ptr, READ_ONCE(*(u8 *)ptr),	\
+				  (u8)i);				\
+		break;							\
+	case 1:								\
+		arch_cmpxchg##sfx((u16 *)ptr, READ_ONCE(*(u16 *)ptr),	\
+				  (u16)i);				\
+		break;							\
+	case 2:								\
+		arch_cmpxchg##sfx((u32 *)ptr, READ_ONCE(*(u32 *)ptr),	\
+				  (u32)i);				\
+		break;							\
+	default:							\
+		arch_cmpxchg##sfx((u64 *)ptr, READ_ONCE(*(u64 *)ptr),	\
+				  (u64)i);				\
+	}								\
+}
+
+ATOMIC_BENCH_CMPXCHG(cmpxchg_relaxed, _relaxed)
+ATOMIC_BENCH_CMPXCHG(cmpxchg_acquire, _acquire)
+ATOMIC_BENCH_CMPXCHG(cmpxchg_release, _release)
+ATOMIC_BENCH_CMPXCHG(cmpxchg_mb, )
+
+/* arch_xchg() of 64-bit without "prfm pstl1strm" */
+static __always_inline void xchg_noprfm_op(void *ptr, unsigned long i,
+					   unsigned int order)
+{
+	unsigned long ret, tmp;
+
+	asm volatile("// xchg_noprfm\n"
+	"1:	ldxr	%0, %2\n"
+	"	stlxr	%w1, %3, %2\n"
+	"	cbnz	%w1, 1b\n"
+	"	dmb	ish"
+	: "=&r" (ret), "=&r" (tmp), "+Q" (*(u64 *)ptr)
+	: "r" (i)
+	: "memory");
+}
+
+#define ATOMIC_BENCH_OP(name, mode, args...)				\
+static void name##_##mode##_op(struct bench_thread *thread,		\
+			       unsigned long i)				\
+{									\
+	name##_op(atomic_bench_ptr(thread, ATOMIC_BENCH_##mode), i, ##args);\
+}
+
+#define ATOMIC_BENCH_OPS(name, args...)					\
+ATOMIC_BENCH_OP(name, NONE, ##args)					\
+ATOMIC_BENCH_OP(name, SHARED, ##args)					\
+ATOMIC_BENCH_OP(name, FALSE, ##args)
+
+ATOMIC_BENCH_OPS(plain)
+ATOMIC_BENCH_OPS(add)
+ATOMIC_BENCH_OPS(add_return_relaxed)
+ATOMIC_BENCH_OPS(add_return_acquire)
+ATOMIC_BENCH_OPS(add_return_release)
+ATOMIC_BENCH_OPS(add_return_mb)
+ATOMIC_BENCH_OPS(xchg_relaxed, thread->ctx->order)
+ATOMIC_BENCH_OPS(xchg_acquire, thread->ctx->order)
+ATOMIC_BENCH_OPS(xchg_release, thread->ctx->order)
+ATOMIC_BENCH_OPS(xchg_mb, thread->ctx->order)
+ATOMIC_BENCH_OPS(xchg_noprfm, thread->ctx->order)
+ATOMIC_BENCH_OPS(cmpxchg_relaxed, thread->ctx->order)
+ATOMIC_BENCH_OPS(cmpxchg_acquire, thread->ctx->order)
+ATOMIC_BENCH_OPS(cmpxchg_release, thread->ctx->order)
+ATOMIC_BENCH_OPS(cmpxchg_mb, thread->ctx->order)
+
+static const int atomic_bench_sizes[] = { 0, 1, 2, 3, -1 };
+static const int atomic_bench_u64[] = { 3, -1 };
+
+#define ATOMIC_BENCH_WORKLOAD(str, fn, mode, mstr, sizes) {		\
+	.name		= "atomic-" str "-" mstr,			\
+	.orders		= sizes,					\
+	.setup		= atomic_bench_setup,				\
+	.op		= fn##_##mode##_op,				\
+	.teardown	= atomic_bench_teardown,			\
+}
+
+#define ATOMIC_BENCH_WORKLOADS(str, fn, sizes)				\
+	ATOMIC_BENCH_WORKLOAD(str, fn, NONE, "none", sizes),		\
+	ATOMIC_BENCH_WORKLOAD(str, fn, SHARED, "shared", sizes),	\
+	ATOMIC_BENCH_WORKLOAD(str, fn, FALSE, "false", sizes)
+
+const struct bench_workload atomic_workloads[] = {
+	ATOMIC_BENCH_WORKLOADS("plain", plain, atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("add", add, atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("add-return-relaxed", add_return_relaxed,
+			       atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("add-return-acquire", add_return_acquire,
+			       atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("add-return-release", add_return_release,
+			       atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("add-return-mb", add_return_mb,
+			       atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("xchg-relaxed", xchg_relaxed,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("xchg-acquire", xchg_acquire,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("xchg-release", xchg_release,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("xchg-mb", xchg_mb, atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("xchg-noprfm", xchg_noprfm, atomic_bench_u64),
+	ATOMIC_BENCH_WORKLOADS("cmpxchg-relaxed", cmpxchg_relaxed,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("cmpxchg-acquire", cmpxchg_acquire,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("cmpxchg-release", cmpxchg_release,
+			       atomic_bench_sizes),
+	ATOMIC_BENCH_WORKLOADS("cmpxchg-mb", cmpxchg_mb, atomic_bench_sizes),
+	{
+		.name		= NULL,
+	},
+};
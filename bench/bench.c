@@ -0,0 +1,411 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Benchmark harness
+ *
+ * Usage: mbox-bench [-n size[,size...]] [-t threads[,threads...]]
+ *                   [-o ops] [-b batch] [-w workload] [-z theta] [-s seed]
+ *                   [-P] [-a] [-S] [-p distance]
+ *
+ * The hardware counters are reported per operation unless -P is given
+ * or the kernel denies the access. With -a, the threads are pinned to
+ * the allowed CPUs in turn. -S sweeps the pinned threads from one to the
+ * number of the allowed CPUs, and reports the throughput curve of every
+ * workload, which are the mixed ones by default. -p sets the prefetch
+ * distance of the xarray iteration.
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <mbox/timestamp.h>
+#include <mbox/xarray.h>
+#include "bench.h"
+
+#define BENCH_MAX_LIST		16
+
+static pthread_barrier_t bench_barrier;
+static cpu_set_t bench_cpus;
+
+static const struct bench_workload *bench_suites[] = {
+	xarray_workloads,
+#ifdef CONFIG_BENCH_ATOMIC
+	atomic_workloads,
+#endif
+	NULL,
+};
+
+/* Pin the thread to the allowed CPU of its index */
+static void bench_pin(struct bench_thread *thread)
+{
+	unsigned int nr = CPU_COUNT(&bench_cpus), n, cpu;
+	cpu_set_t set;
+
+	n = thread->id % (nr ? : 1);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &bench_cpus) || n--)
+			continue;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+		break;
+	}
+}
+
+/* xorshift64* */
+u64 bench_rand(struct bench_thread *thread)
+{
+	u64 x = thread->rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	thread->rand = x;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Generate the keys in [0, size) with the Zipfian distribution, using the
+ * algorithm in "Quickly Generating Billion-Record Synthetic Databases".
+ * The keys are generated in advance so that the cost of pow() isn't
+ * counted in the operations.
+ */
+unsigned long *bench_zipf_keys(struct bench_ctx *ctx, unsigned long nr)
+{
+	struct bench_thread thread = { .rand = ctx->seed | 1 };
+	double theta = ctx->theta, zeta = 0, zeta2, alpha, eta, u, uz;
+	unsigned long *keys, i, n = ctx->size;
+
+	keys = malloc(nr * sizeof(*keys));
+	if (!keys)
+		return NULL;
+
+	for (i = 1; i <= n; i++)
+		zeta += 1.0 / pow(i, theta);
+	zeta2 = 1.0 + pow(0.5, theta);
+	alpha = 1.0 / (1.0 - theta);
+	eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zeta);
+
+	for (i = 0; i < nr; i++) {
+		u = (double)(bench_rand(&thread) >> 11) / (1ULL << 53);
+		uz = u * zeta;
+		if (uz < 1.0)
+			keys[i] = 0;
+		else if (uz < zeta2)
+			keys[i] = 1;
+		else
+			keys[i] = (unsigned long)(n * pow(eta * u - eta + 1, alpha));
+		if (keys[i] >= n)
+			keys[i] = n - 1;
+	}
+
+	return keys;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *thread = arg;
+	struct bench_ctx *ctx = thread->ctx;
+	void (*op)(struct bench_thread *, unsigned long) = ctx->workload->op;
+	unsigned long i = 0, j, end;
+	u64 start;
+
+	if (ctx->pin)
+		bench_pin(thread);
+
+	pthread_barrier_wait(&bench_barrier);
+
+	if (ctx->perf)
+		bench_perf_start(&thread->perf);
+
+	while (i < ctx->ops) {
+		end = i + ctx->batch;
+		if (end > ctx->ops)
+			end = ctx->ops;
+
+		start = timestamp();
+		for (j = i; j < end; j++)
+			op(thread, j);
+		thread->samples[thread->nr_samples++] =
+			timestamp_to_ns(timestamp() - start) / (end - i);
+
+		i = end;
+	}
+
+	if (ctx->perf)
+		bench_perf_stop(&thread->perf);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static u64 percentile(const u64 *samples, unsigned long nr, double p)
+{
+	unsigned long i = (unsigned long)(nr * p);
+
+	return nr ? samples[i < nr ? i : nr - 1] : 0;
+}
+
+static void bench_report_perf(struct bench_ctx *ctx,
+			      struct bench_thread *threads, double ops)
+{
+	unsigned int event, i;
+	u64 sum;
+
+	for (event = 0; ctx->perf && event < BENCH_PERF_NR; event++) {
+		for (sum = 0, i = 0; i < ctx->threads; i++) {
+			if (!threads[i].perf.valid[event])
+				break;
+
+			sum += threads[i].perf.values[event];
+		}
+
+		if (i == ctx->threads) {
+			fprintf(stdout, ", \"%s_per_op\": %.3f",
+				bench_perf_name(event), sum / ops);
+		}
+	}
+}
+
+static void bench_report(struct bench_ctx *ctx, struct bench_thread *threads,
+			 u64 elapsed)
+{
+	unsigned long nr = 0, i, j;
+	u64 *samples;
+	double ops = (double)ctx->ops * ctx->threads;
+
+	for (i = 0; i < ctx->threads; i++)
+		nr += threads[i].nr_samples;
+
+	samples = malloc((nr ? : 1) * sizeof(*samples));
+	if (!samples)
+		return;
+
+	for (nr = 0, i = 0; i < ctx->threads; i++) {
+		for (j = 0; j < threads[i].nr_samples; j++)
+			samples[nr++] = threads[i].samples[j];
+	}
+	qsort(samples, nr, sizeof(*samples), cmp_u64);
+	ctx->ops_per_sec = elapsed ? ops * NSEC_PER_SEC / elapsed : 0;
+
+	fprintf(stdout, "{\"workload\": \"%s\", \"order\": %u, "
+		"\"size\": %lu, \"threads\": %u, \"ops\": %.0f, "
+		"\"ops_per_sec\": %.0f, \"ns_per_op\": %.2f, "
+		"\"ns_p50\": %llu, \"ns_p90\": %llu, "
+		"\"ns_p99\": %llu, \"ns_p999\": %llu, \"ns_max\": %llu, "
+		"\"bytes_per_entry\": %.2f",
+		ctx->workload->name, ctx->order, ctx->size, ctx->threads, ops,
+		ctx->ops_per_sec, ops ? (double)elapsed * ctx->threads / ops : 0,
+		(unsigned long long)percentile(samples, nr, 0.50),
+		(unsigned long long)percentile(samples, nr, 0.90),
+		(unsigned long long)percentile(samples, nr, 0.99),
+		(unsigned long long)percentile(samples, nr, 0.999),
+		(unsigned long long)(nr ? samples[nr - 1] : 0),
+		ctx->entries ? (double)ctx->bytes / ctx->entries : 0);
+	bench_report_perf(ctx, threads, ops);
+	fprintf(stdout, "}\n");
+	fflush(stdout);
+
+	free(samples);
+}
+
+static int bench_run(struct bench_ctx *ctx)
+{
+	struct bench_thread *threads;
+	pthread_t *tids;
+	unsigned long nr_samples = DIV_ROUND_UP(ctx->ops, ctx->batch);
+	unsigned int i;
+	u64 start, end;
+	int ret = -ENOMEM;
+
+	threads = calloc(ctx->threads, sizeof(*threads));
+	tids = calloc(ctx->threads, sizeof(*tids));
+	if (!threads || !tids)
+		goto out;
+
+	for (i = 0; i < ctx->threads; i++) {
+		threads[i].ctx = ctx;
+		threads[i].id = i;
+		threads[i].rand = (ctx->seed + i) * 0x9e3779b97f4a7c15ULL | 1;
+		threads[i].samples = malloc(nr_samples * sizeof(u64));
+		if (!threads[i].samples)
+			goto out;
+	}
+
+	ret = ctx->workload->setup(ctx);
+	if (ret)
+		goto out;
+
+	pthread_barrier_init(&bench_barrier, NULL, ctx->threads + 1);
+	for (i = 0; i < ctx->threads; i++)
+		pthread_create(&tids[i], NULL, bench_thread_fn, &threads[i]);
+
+	pthread_barrier_wait(&bench_barrier);
+	start = timestamp_ordered();
+	for (i = 0; i < ctx->threads; i++)
+		pthread_join(tids[i], NULL);
+	end = timestamp_ordered();
+	pthread_barrier_destroy(&bench_barrier);
+
+	ctx->workload->teardown(ctx);
+	bench_report(ctx, threads, timestamp_to_ns(end - start));
+out:
+	for (i = 0; threads && i < ctx->threads; i++)
+		free(threads[i].samples);
+	free(threads);
+	free(tids);
+	return ret;
+}
+
+static int parse_list(char *arg, unsigned long *list)
+{
+	char *tok, *save = NULL;
+	int nr = 0;
+
+	for (tok = strtok_r(arg, ",", &save);
+	     tok && nr < BENCH_MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save))
+		list[nr++] = strtoul(tok, NULL, 0);
+
+	return nr;
+}
+
+static void bench_curve(struct bench_ctx *ctx, const unsigned long *threads,
+			const double *results, int nr)
+{
+	int i;
+
+	fprintf(stdout, "{\"curve\": \"%s\", \"order\": %u, \"size\": %lu, "
+		"\"threads\": [", ctx->workload->name, ctx->order, ctx->size);
+	for (i = 0; i < nr; i++)
+		fprintf(stdout, "%s%lu", i ? ", " : "", threads[i]);
+	fprintf(stdout, "], \"ops_per_sec\": [");
+	for (i = 0; i < nr; i++)
+		fprintf(stdout, "%s%.0f", i ? ", " : "", results[i]);
+	fprintf(stdout, "]}\n");
+}
+
+static void bench_workload(struct bench_ctx *ctx,
+			   const struct bench_workload *w,
+			   const unsigned long *sizes, int nr_sizes,
+			   const unsigned long *threads, int nr_threads,
+			   bool curve)
+{
+	double results[BENCH_MAX_LIST];
+	int i, j, k = 0;
+
+	ctx->workload = w;
+	do {
+		ctx->order = w->orders ? w->orders[k] : 0;
+		for (i = 0; i < nr_sizes; i++) {
+			ctx->size = sizes[i] ? : 1;
+			for (j = 0; j < nr_threads; j++) {
+				ctx->threads = threads[j] ? : 1;
+				ctx->ops_per_sec = 0;
+				if (bench_run(ctx))
+					fprintf(stderr, "%s: Failed\n", w->name);
+				results[j] = ctx->ops_per_sec;
+			}
+
+			if (curve)
+				bench_curve(ctx, threads, results, nr_threads);
+		}
+	} while (w->orders && w->orders[++k] >= 0);
+}
+
+int main(int argc, char **argv)
+{
+	const struct bench_workload **suite, *w;
+	struct bench_ctx ctx = {
+		.ops	= 1000000,
+		.batch	= 1,
+		.seed	= 1,
+		.theta	= 0.99,
+		.perf	= true,
+	};
+	unsigned long sizes[BENCH_MAX_LIST] = { 1UL << 20 };
+	unsigned long threads[BENCH_MAX_LIST] = { 1 };
+	int nr_sizes = 1, nr_threads = 1, nr_cpus, opt;
+	const char *filter = NULL;
+	bool sweep = false;
+
+	while ((opt = getopt(argc, argv, "n:t:o:b:w:z:s:PaSp:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_sizes = parse_list(optarg, sizes);
+			break;
+		case 't':
+			nr_threads = parse_list(optarg, threads);
+			break;
+		case 'o':
+			ctx.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			ctx.batch = strtoul(optarg, NULL, 0) ? : 1;
+			break;
+		case 'w':
+			filter = optarg;
+			break;
+		case 'z':
+			ctx.theta = strtod(optarg, NULL);
+			break;
+		case 's':
+			ctx.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'P':
+			ctx.perf = false;
+			break;
+		case 'a':
+			ctx.pin = true;
+			break;
+		case 'S':
+			sweep = true;
+			break;
+		case 'p':
+			xa_prefetch_distance = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n size[,size...]] "
+				"[-t threads[,threads...]] [-o ops] [-b batch] "
+				"[-w workload] [-z theta] [-s seed] [-P] [-a] "
+				"[-S] [-p distance]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (sched_getaffinity(0, sizeof(bench_cpus), &bench_cpus))
+		CPU_ZERO(&bench_cpus);
+
+	/* 1, 2, 4, ... and the number of the allowed CPUs */
+	if (sweep) {
+		nr_cpus = CPU_COUNT(&bench_cpus) ? : 1;
+		for (nr_threads = 0; nr_threads < BENCH_MAX_LIST - 1 &&
+		     (1 << nr_threads) < nr_cpus; nr_threads++)
+			threads[nr_threads] = 1 << nr_threads;
+		threads[nr_threads++] = nr_cpus;
+
+		ctx.pin = true;
+		if (!filter)
+			filter = "mixed";
+	}
+
+	for (suite = bench_suites; *suite; suite++) {
+		for (w = *suite; w->name; w++) {
+			if (filter && strncmp(w->name, filter, strlen(filter)))
+				continue;
+
+			bench_workload(&ctx, w, sizes, nr_sizes,
+				       threads, nr_threads, sweep);
+		}
+	}
+
+	return 0;
+}
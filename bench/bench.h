@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Benchmark harness. A workload is set up once, then its operation is
+ * run by the threads concurrently and the latency is sampled every
+ * batch of operations. The results are reported as JSON lines.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __BENCH_BENCH_H
+#define __BENCH_BENCH_H
+
+#include <mbox/base.h>
+
+struct bench_ctx;
+
+enum bench_perf_event {
+	BENCH_PERF_CYCLES,
+	BENCH_PERF_INSTRUCTIONS,
+	BENCH_PERF_L1D_MISSES,
+	BENCH_PERF_LLC_MISSES,
+	BENCH_PERF_DTLB_MISSES,
+	BENCH_PERF_BRANCH_MISSES,
+	BENCH_PERF_NR,
+};
+
+struct bench_perf {
+	int	fds[BENCH_PERF_NR];
+	bool	valid[BENCH_PERF_NR];
+	u64	values[BENCH_PERF_NR];
+};
+
+struct bench_thread {
+	struct bench_ctx	*ctx;
+	unsigned int		id;		/* Thread index */
+	u64			rand;		/* Random state */
+	unsigned long		nr_samples;
+	u64			*samples;	/* Latency in ns per batch */
+	struct bench_perf	perf;		/* Hardware counters */
+};
+
+struct bench_ctx {
+	const struct bench_workload	*workload;
+	unsigned long			size;		/* Entries */
+	unsigned int			threads;
+	unsigned long			ops;		/* Ops per thread */
+	unsigned int			batch;		/* Ops per sample */
+	unsigned int			order;		/* Workload order */
+	u64				seed;
+	double				theta;		/* Zipfian skew */
+	bool				perf;		/* Hardware counters */
+	bool				pin;		/* Pin the threads */
+	void				*priv;		/* Workload data */
+	unsigned long			bytes;		/* Memory in use */
+	unsigned long			entries;	/* Entries in use */
+	double				ops_per_sec;	/* Throughput */
+};
+
+/*
+ * @setup prepares the data, which is shared by all threads. @op runs the
+ * @i-th operation of the thread. @teardown reports the memory usage to
+ * bench_ctx::bytes and bench_ctx::entries, and releases the data. The
+ * workload is run once for each order in @orders, which is terminated
+ * by -1, if it's specified.
+ */
+struct bench_workload {
+	const char	*name;
+	const int	*orders;
+	int		(*setup)(struct bench_ctx *ctx);
+	void		(*op)(struct bench_thread *thread, unsigned long i);
+	void		(*teardown)(struct bench_ctx *ctx);
+};
+
+extern const struct bench_workload xarray_workloads[];
+extern const struct bench_workload atomic_workloads[];
+
+const char *bench_perf_name(unsigned int event);
+void bench_perf_start(struct bench_perf *perf);
+void bench_perf_stop(struct bench_perf *perf);
+
+u64 bench_rand(struct bench_thread *thread);
+unsigned long *bench_zipf_keys(struct bench_ctx *ctx, unsigned long nr);
+
+#endif /* __BENCH_BENCH_H */
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Hardware performance counters. Every benchmark thread opens its own
+ * counters around the measured loop. The counters which can't be opened,
+ * because the kernel denies the access or the hardware doesn't have them,
+ * are skipped and the benchmark falls back to timing only.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "bench.h"
+
+#define HW_CACHE(cache)	(PERF_COUNT_HW_CACHE_##cache |			\
+			 (PERF_COUNT_HW_CACHE_OP_READ << 8) |		\
+			 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	const char	*name;
+	u32		type;
+	u64		config;
+} bench_perf_events[BENCH_PERF_NR] = {
+	[BENCH_PERF_CYCLES]	  = { "cycles", PERF_TYPE_HARDWARE,
+				      PERF_COUNT_HW_CPU_CYCLES },
+	[BENCH_PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE,
+				      PERF_COUNT_HW_INSTRUCTIONS },
+	[BENCH_PERF_L1D_MISSES]	  = { "l1d_misses", PERF_TYPE_HW_CACHE,
+				      HW_CACHE(L1D) },
+	[BENCH_PERF_LLC_MISSES]	  = { "llc_misses", PERF_TYPE_HW_CACHE,
+				      HW_CACHE(LL) },
+	[BENCH_PERF_DTLB_MISSES]  = { "dtlb_misses", PERF_TYPE_HW_CACHE,
+				      HW_CACHE(DTLB) },
+	[BENCH_PERF_BRANCH_MISSES] = { "branch_misses", PERF_TYPE_HARDWARE,
+				       PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+const char *bench_perf_name(unsigned int event)
+{
+	return bench_perf_events[event].name;
+}
+
+void bench_perf_start(struct bench_perf *perf)
+{
+	struct perf_event_attr attr;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_PERF_NR; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = bench_perf_events[i].type;
+		attr.config = bench_perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		perf->values[i] = 0;
+		perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	for (i = 0; i < BENCH_PERF_NR; i++) {
+		if (perf->fds[i] >= 0)
+			ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/* The values are scaled up if the counters have been multiplexed */
+void bench_perf_stop(struct bench_perf *perf)
+{
+	u64 data[3];	/* value, time enabled, time running */
+	unsigned int i;
+
+	for (i = 0; i < BENCH_PERF_NR; i++) {
+		if (perf->fds[i] >= 0)
+			ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	for (i = 0; i < BENCH_PERF_NR; i++) {
+		perf->valid[i] = false;
+		if (perf->fds[i] < 0)
+			continue;
+
+		if (read(perf->fds[i], data, sizeof(data)) == sizeof(data) &&
+		    data[2]) {
+			perf->values[i] = data[2] < data[1] ?
+				(unsigned __int128)data[0] * data[1] / data[2] :
+				data[0];
+			perf->valid[i] = true;
+		}
+
+		close(perf->fds[i]);
+		perf->fds[i] = -1;
+	}
+}
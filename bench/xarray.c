@@ -0,0 +1,646 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * eXtensible Array benchmarks
+ */
+
+#include <limits.h>
+#include <mbox/xarray.h>
+#include "bench.h"
+
+#define XA_BENCH_SPARSE_MULT	0x9e3779b97f4a7c15UL
+#define XA_BENCH_MARK_STRIDE	8
+#define XA_BENCH_PERCENT	100
+#define XA_BENCH_EXTENT_SHIFT	8
+#define XA_BENCH_BUILD_SHIFT	12
+
+struct xa_bench_cursor {
+	unsigned long	index;
+} ____cacheline_aligned;
+
+struct xa_bench {
+	struct xarray		xa;
+	unsigned long		*keys;		/* Zipfian or sorted keys */
+	void			**entries;	/* Entries of the sorted keys */
+	struct xa_bench_cursor	*cursors;	/* Per-thread cursors */
+};
+
+static struct xa_bench *xa_bench(struct bench_thread *thread)
+{
+	return thread->ctx->priv;
+}
+
+/* The operations of the threads are interleaved */
+static unsigned long xa_bench_seq(struct bench_thread *thread, unsigned long i)
+{
+	return i * thread->ctx->threads + thread->id;
+}
+
+static int __xa_bench_init(struct bench_ctx *ctx, unsigned int flags)
+{
+	struct xa_bench *b = calloc(1, sizeof(*b));
+
+	if (!b)
+		return -ENOMEM;
+
+	xa_init_flags(&b->xa, XA_FLAGS_ACCOUNT | flags);
+	ctx->priv = b;
+
+	return 0;
+}
+
+static int xa_bench_init(struct bench_ctx *ctx)
+{
+	return __xa_bench_init(ctx, 0);
+}
+
+static int xa_bench_compress_init(struct bench_ctx *ctx)
+{
+	return __xa_bench_init(ctx, XA_FLAGS_COMPRESS);
+}
+
+static int xa_bench_coalesce_init(struct bench_ctx *ctx)
+{
+	return __xa_bench_init(ctx, XA_FLAGS_COALESCE);
+}
+
+static int xa_bench_adaptive_init(struct bench_ctx *ctx)
+{
+	return __xa_bench_init(ctx, XA_FLAGS_ADAPTIVE);
+}
+
+static int xa_bench_packed_init(struct bench_ctx *ctx)
+{
+	return __xa_bench_init(ctx, XA_FLAGS_PACKED);
+}
+
+static int __xa_bench_populate(struct bench_ctx *ctx, unsigned long stride,
+			       unsigned int flags)
+{
+	struct xa_bench *b;
+	unsigned long i;
+	int ret;
+
+	ret = __xa_bench_init(ctx, flags);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	for (i = 0; i < ctx->size; i++) {
+		ret = xa_err(xa_store(&b->xa, i * stride, xa_mk_value(i)));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int xa_bench_populate(struct bench_ctx *ctx, unsigned long stride)
+{
+	return __xa_bench_populate(ctx, stride, 0);
+}
+
+static void xa_bench_teardown(struct bench_ctx *ctx)
+{
+	struct xa_bench *b = ctx->priv;
+	struct xa_account account;
+
+	xa_get_account(&b->xa, &account);
+	ctx->bytes = account.node_bytes + sizeof(b->xa);
+	ctx->entries = account.nr_entries;
+
+	xa_destroy(&b->xa);
+	free(b->keys);
+	free(b->entries);
+	free(b->cursors);
+	free(b);
+	ctx->priv = NULL;
+}
+
+static int load_setup(struct bench_ctx *ctx)
+{
+	return xa_bench_populate(ctx, 1);
+}
+
+static int load_hint_setup(struct bench_ctx *ctx)
+{
+	return __xa_bench_populate(ctx, 1, XA_FLAGS_HINT);
+}
+
+static int load_huge_setup(struct bench_ctx *ctx)
+{
+	return __xa_bench_populate(ctx, 1, XA_FLAGS_HUGE);
+}
+
+static int load_adaptive_setup(struct bench_ctx *ctx)
+{
+	return __xa_bench_populate(ctx, 1, XA_FLAGS_ADAPTIVE);
+}
+
+static void load_seq_op(struct bench_thread *thread, unsigned long i)
+{
+	xa_load(&xa_bench(thread)->xa,
+		xa_bench_seq(thread, i) % thread->ctx->size);
+}
+
+static void load_random_op(struct bench_thread *thread, unsigned long i)
+{
+	xa_load(&xa_bench(thread)->xa, bench_rand(thread) % thread->ctx->size);
+}
+
+static int load_zipf_setup(struct bench_ctx *ctx)
+{
+	struct xa_bench *b;
+	int ret;
+
+	ret = xa_bench_populate(ctx, 1);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	b->keys = bench_zipf_keys(ctx, ctx->ops * ctx->threads);
+
+	return b->keys ? 0 : -ENOMEM;
+}
+
+static void load_zipf_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+
+	xa_load(&b->xa, b->keys[xa_bench_seq(thread, i)]);
+}
+
+static void store_dense_op(struct bench_thread *thread, unsigned long i)
+{
+	unsigned long index = xa_bench_seq(thread, i) % thread->ctx->size;
+
+	xa_store(&xa_bench(thread)->xa, index, xa_mk_value(index));
+}
+
+/* Spread the indexes over the whole 64-bit space, like hashes */
+static void store_sparse_op(struct bench_thread *thread, unsigned long i)
+{
+	unsigned long index = xa_bench_seq(thread, i) % thread->ctx->size;
+
+	xa_store(&xa_bench(thread)->xa, index * XA_BENCH_SPARSE_MULT,
+		 xa_mk_value(index));
+}
+
+/* Map the extents of 256 indexes piecemeal, like an extent mapper */
+static void store_uniform_op(struct bench_thread *thread, unsigned long i)
+{
+	unsigned long index = xa_bench_seq(thread, i) % thread->ctx->size;
+
+	xa_store(&xa_bench(thread)->xa, index,
+		 xa_mk_value(index >> XA_BENCH_EXTENT_SHIFT));
+}
+
+/* Keep a flag for every index, like a bitmap */
+static void store_bits_op(struct bench_thread *thread, unsigned long i)
+{
+	unsigned long index = xa_bench_seq(thread, i) % thread->ctx->size;
+
+	xa_store(&xa_bench(thread)->xa, index, xa_mk_value(index & 1));
+}
+
+static const int store_range_orders[] = { 0, 4, 8, 12, -1 };
+
+static void store_range_op(struct bench_thread *thread, unsigned long i)
+{
+	unsigned int order = thread->ctx->order;
+	unsigned long nr = thread->ctx->size >> order;
+	unsigned long first = (xa_bench_seq(thread, i) % (nr ? : 1)) << order;
+
+	xa_store_range(&xa_bench(thread)->xa, first,
+		       first + (1UL << order) - 1, xa_mk_value(first));
+}
+
+static void erase_churn_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long index = bench_rand(thread) % thread->ctx->size;
+
+	xa_erase(&b->xa, index);
+	xa_store(&b->xa, index, xa_mk_value(index));
+}
+
+static int __find_setup(struct bench_ctx *ctx, unsigned int flags)
+{
+	struct xa_bench *b;
+	size_t size;
+	int ret;
+
+	ret = __xa_bench_populate(ctx, 4, flags);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	size = ctx->threads * sizeof(*b->cursors);
+	if (posix_memalign((void **)&b->cursors, SMP_CACHE_BYTES, size))
+		return -ENOMEM;
+
+	memset(b->cursors, 0, size);
+	return 0;
+}
+
+static int find_setup(struct bench_ctx *ctx)
+{
+	return __find_setup(ctx, 0);
+}
+
+static int find_adaptive_setup(struct bench_ctx *ctx)
+{
+	return __find_setup(ctx, XA_FLAGS_ADAPTIVE);
+}
+
+static int rank_setup(struct bench_ctx *ctx)
+{
+	return __xa_bench_populate(ctx, 1, XA_FLAGS_COUNT);
+}
+
+/* The rank of a random index, which a scan would take O(n) for */
+static void rank_op(struct bench_thread *thread, unsigned long i)
+{
+	xa_rank(&xa_bench(thread)->xa, bench_rand(thread) % thread->ctx->size);
+}
+
+static void find_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long *index = &b->cursors[thread->id].index;
+
+	if (!xa_find_after(&b->xa, index, ULONG_MAX, XA_PRESENT)) {
+		*index = 0;
+		xa_find(&b->xa, index, ULONG_MAX, XA_PRESENT);
+	}
+}
+
+static int mark_setup(struct bench_ctx *ctx)
+{
+	struct xa_bench *b;
+	unsigned long i;
+	int ret;
+
+	ret = find_setup(ctx);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	for (i = 0; i < ctx->size; i += XA_BENCH_MARK_STRIDE)
+		xa_set_mark(&b->xa, i * 4, XA_MARK_0);
+
+	return 0;
+}
+
+static void mark_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long *index = &b->cursors[thread->id].index;
+
+	if (!xa_find_after(&b->xa, index, ULONG_MAX, XA_MARK_0)) {
+		*index = 0;
+		xa_find(&b->xa, index, ULONG_MAX, XA_MARK_0);
+	}
+}
+
+/* Every other entry with MARK_0 has MARK_1 as well */
+static int mark_expr_setup(struct bench_ctx *ctx)
+{
+	struct xa_bench *b;
+	unsigned long i;
+	int ret;
+
+	ret = mark_setup(ctx);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	for (i = 0; i < ctx->size; i += 2 * XA_BENCH_MARK_STRIDE)
+		xa_set_mark(&b->xa, i * 4, XA_MARK_1);
+
+	return 0;
+}
+
+#define XA_BENCH_EXPR	(XA_MARKS(XA_MARK_0) & ~XA_MARKS(XA_MARK_1))
+
+static void mark_expr_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long *index = &b->cursors[thread->id].index;
+
+	if (!xa_find_marks_after(&b->xa, index, ULONG_MAX, XA_BENCH_EXPR)) {
+		*index = 0;
+		xa_find_marks(&b->xa, index, ULONG_MAX, XA_BENCH_EXPR);
+	}
+}
+
+/* The same search by one mark, checking the other one per entry */
+static void mark_expr_get_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long *index = &b->cursors[thread->id].index;
+	unsigned long start = *index;
+	bool wrapped = false;
+
+	/* A full pass without a match is a miss */
+	do {
+		if (!xa_find_after(&b->xa, index, ULONG_MAX, XA_MARK_0)) {
+			if (wrapped)
+				return;
+			wrapped = true;
+			*index = 0;
+			if (!xa_find(&b->xa, index, ULONG_MAX, XA_MARK_0))
+				return;
+		}
+		if (wrapped && *index >= start)
+			return;
+	} while (xa_get_mark(&b->xa, *index, XA_MARK_1));
+}
+
+/* Marks a block of entries and clears it again, by range or per entry */
+static void mark_range_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long first, last;
+
+	first = (xa_bench_seq(thread, i) << XA_BENCH_EXTENT_SHIFT) %
+		thread->ctx->size;
+	last = first + (1UL << XA_BENCH_EXTENT_SHIFT) - 1;
+
+	xa_set_mark_range(&b->xa, first, last, XA_MARK_0);
+	xa_clear_mark_range(&b->xa, first, last, XA_MARK_0);
+}
+
+static void mark_range_index_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long first, last, index;
+
+	first = (xa_bench_seq(thread, i) << XA_BENCH_EXTENT_SHIFT) %
+		thread->ctx->size;
+	last = first + (1UL << XA_BENCH_EXTENT_SHIFT) - 1;
+
+	for (index = first; index <= last; index++)
+		xa_set_mark(&b->xa, index, XA_MARK_0);
+	for (index = first; index <= last; index++)
+		xa_clear_mark(&b->xa, index, XA_MARK_0);
+}
+
+/* The sorted keys are built into arrays of 4096 entries */
+static int build_setup(struct bench_ctx *ctx)
+{
+	struct xa_bench *b;
+	unsigned long i;
+	int ret;
+
+	ret = xa_bench_init(ctx);
+	if (ret)
+		return ret;
+
+	b = ctx->priv;
+	b->keys = malloc(ctx->size * sizeof(*b->keys));
+	b->entries = malloc(ctx->size * sizeof(*b->entries));
+	if (!b->keys || !b->entries)
+		return -ENOMEM;
+
+	for (i = 0; i < ctx->size; i++) {
+		b->keys[i] = i * 4;
+		b->entries[i] = xa_mk_value(i);
+	}
+
+	return 0;
+}
+
+/* The batch is the whole key set when it's smaller than the batch size */
+static unsigned long build_batch(const struct bench_ctx *ctx)
+{
+	unsigned long nr = 1UL << XA_BENCH_BUILD_SHIFT;
+
+	return ctx->size < nr ? ctx->size : nr;
+}
+
+static unsigned long build_first(struct bench_thread *thread, unsigned long i)
+{
+	unsigned long nr = thread->ctx->size >> XA_BENCH_BUILD_SHIFT;
+
+	return (xa_bench_seq(thread, i) % (nr ? : 1)) << XA_BENCH_BUILD_SHIFT;
+}
+
+static void build_sorted_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long first = build_first(thread, i);
+	struct xarray xa;
+
+	xa_init(&xa);
+	xa_build_sorted(&xa, &b->keys[first], &b->entries[first],
+			build_batch(thread->ctx), 1);
+	xa_destroy(&xa);
+}
+
+static void build_store_op(struct bench_thread *thread, unsigned long i)
+{
+	struct xa_bench *b = xa_bench(thread);
+	unsigned long first = build_first(thread, i), j;
+	unsigned long last = first + build_batch(thread->ctx);
+	struct xarray xa;
+
+	xa_init(&xa);
+	for (j = first; j < last; j++)
+		xa_store(&xa, b->keys[j], b->entries[j]);
+	xa_destroy(&xa);
+}
+
+/* Loads with the given percentage, stores otherwise */
+static void mixed_op(struct bench_thread *thread, unsigned int reads)
+{
+	struct xa_bench *b = xa_bench(thread);
+	u64 r = bench_rand(thread);
+	unsigned long index = r % thread->ctx->size;
+
+	if ((r >> 32) % XA_BENCH_PERCENT < reads)
+		xa_load(&b->xa, index);
+	else
+		xa_store(&b->xa, index, xa_mk_value(index));
+}
+
+static void mixed_100_op(struct bench_thread *thread, unsigned long i)
+{
+	mixed_op(thread, 100);
+}
+
+static void mixed_95_op(struct bench_thread *thread, unsigned long i)
+{
+	mixed_op(thread, 95);
+}
+
+static void mixed_50_op(struct bench_thread *thread, unsigned long i)
+{
+	mixed_op(thread, 50);
+}
+
+const struct bench_workload xarray_workloads[] = {
+	{
+		.name		= "load-seq",
+		.setup		= load_setup,
+		.op		= load_seq_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-seq-hint",
+		.setup		= load_hint_setup,
+		.op		= load_seq_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-random-hint",
+		.setup		= load_hint_setup,
+		.op		= load_random_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-random-huge",
+		.setup		= load_huge_setup,
+		.op		= load_random_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-random",
+		.setup		= load_setup,
+		.op		= load_random_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-random-adaptive",
+		.setup		= load_adaptive_setup,
+		.op		= load_random_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "load-zipf",
+		.setup		= load_zipf_setup,
+		.op		= load_zipf_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-dense",
+		.setup		= xa_bench_init,
+		.op		= store_dense_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-dense-adaptive",
+		.setup		= xa_bench_adaptive_init,
+		.op		= store_dense_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-sparse",
+		.setup		= xa_bench_init,
+		.op		= store_sparse_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-sparse-compress",
+		.setup		= xa_bench_compress_init,
+		.op		= store_sparse_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-sparse-adaptive",
+		.setup		= xa_bench_adaptive_init,
+		.op		= store_sparse_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-uniform",
+		.setup		= xa_bench_init,
+		.op		= store_uniform_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-uniform-coalesce",
+		.setup		= xa_bench_coalesce_init,
+		.op		= store_uniform_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-bits",
+		.setup		= xa_bench_init,
+		.op		= store_bits_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-bits-packed",
+		.setup		= xa_bench_packed_init,
+		.op		= store_bits_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "store-range",
+		.orders		= store_range_orders,
+		.setup		= xa_bench_init,
+		.op		= store_range_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "erase-churn",
+		.setup		= load_setup,
+		.op		= erase_churn_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "erase-churn-adaptive",
+		.setup		= load_adaptive_setup,
+		.op		= erase_churn_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "find-scan",
+		.setup		= find_setup,
+		.op		= find_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "find-scan-adaptive",
+		.setup		= find_adaptive_setup,
+		.op		= find_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "rank-count",
+		.setup		= rank_setup,
+		.op		= rank_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mark-scan",
+		.setup		= mark_setup,
+		.op		= mark_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mark-expr",
+		.setup		= mark_expr_setup,
+		.op		= mark_expr_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mark-expr-get",
+		.setup		= mark_expr_setup,
+		.op		= mark_expr_get_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mark-range",
+		.setup		= load_setup,
+		.op		= mark_range_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mark-range-index",
+		.setup		= load_setup,
+		.op		= mark_range_index_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "build-sorted",
+		.setup		= build_setup,
+		.op		= build_sorted_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "build-store",
+		.setup		= build_setup,
+		.op		= build_store_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mixed-100",
+		.setup		= load_setup,
+		.op		= mixed_100_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mixed-95",
+		.setup		= load_setup,
+		.op		= mixed_95_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= "mixed-50",
+		.setup		= load_setup,
+		.op		= mixed_50_op,
+		.teardown	= xa_bench_teardown,
+	}, {
+		.name		= NULL,
+	},
+};
@@ -265,7 +265,7 @@ arch_xchg_case_##name##sz(u##sz x, volatile void *ptr)			\
 
 #define XCHG_GEN(sfx)							\
 static __always_inline unsigned long					\
-arch_xchg##sfx(unsigned long x, volatile void *ptr, int size)		\
+__arch_xchg##sfx(unsigned long x, volatile void *ptr, int size)		\
 {									\
         switch (size) {							\
         case 1:								\
@@ -282,7 +282,7 @@ arch_xchg##sfx(unsigned long x, volatile void *ptr, int size)		\
 #define xchg_wrapper(sfx, ptr, x)	({				\
 	__typeof__(*(ptr)) __ret;					\
 	__ret = (__typeof__(*(ptr)))					\
-	    arch_xchg##sfx((unsigned long)(x), (ptr), sizeof(*(ptr)));	\
+	    __arch_xchg##sfx((unsigned long)(x), (ptr), sizeof(*(ptr)));	\
 	__ret;								\
 })
 
@@ -349,8 +349,8 @@ arch_cmpxchg_case_##name##sz(volatile void *ptr,			\
 
 #define CMPXCHG_GEN(sfx)						\
 static __always_inline unsigned long					\
-arch_cmpxchg##sfx(volatile void *ptr, unsigned long old,		\
-		   unsigned long new, int size)				\
+__arch_cmpxchg##sfx(volatile void *ptr, unsigned long old,		\
+		    unsigned long new, int size)			\
 {									\
 	switch (size) {							\
 	case 1:								\
@@ -367,8 +367,8 @@ arch_cmpxchg##sfx(volatile void *ptr, unsigned long old,		\
 #define cmpxchg_wrapper(sfx, ptr, o, n) ({				\
 	__typeof__(*(ptr)) __ret;					\
 	__ret = (__typeof__(*(ptr)))					\
-		arch_cmpxchg##sfx((ptr), (unsigned long)(o),		\
-				  (unsigned long)(n), sizeof(*(ptr)));	\
+		__arch_cmpxchg##sfx((ptr), (unsigned long)(o),		\
+				    (unsigned long)(n), sizeof(*(ptr)));\
 	__ret;								\
 })
 
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * ARM64 timestamp. The virtual count register (CNTVCT_EL0) is readable
+ * from userspace and it ticks at a constant frequency, which is usually
+ * tens of megahertz and reported by CNTFRQ_EL0. The read can be
+ * speculated unless it's preceded by 'isb'.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __MBOX_ARM64_TIMESTAMP_H
+#define __MBOX_ARM64_TIMESTAMP_H
+
+#include <mbox/base.h>
+
+static __always_inline u64 arch_timestamp(void)
+{
+	u64 val;
+
+	asm volatile("mrs	%0, cntvct_el0" : "=r" (val));
+
+	return val;
+}
+
+static __always_inline u64 arch_timestamp_ordered(void)
+{
+	u64 val;
+
+	asm volatile("isb\n"
+		     "	mrs	%0, cntvct_el0"
+		     : "=r" (val) : : "memory");
+
+	return val;
+}
+
+static __always_inline u64 arch_timestamp_freq(void)
+{
+	u64 val;
+
+	asm volatile("mrs	%0, cntfrq_el0" : "=r" (val));
+
+	return val;
+}
+
+#endif /* __MBOX_ARM64_TIMESTAMP_H */
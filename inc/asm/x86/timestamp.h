@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * x86 timestamp. The time stamp counter is read by 'rdtsc', which ticks
+ * at a constant rate on the processors with invariant TSC. The rate isn't
+ * reported to userspace, so it has to be calibrated. 'rdtsc' can be
+ * executed before the preceding instructions complete unless it's
+ * preceded by 'lfence'.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __MBOX_X86_TIMESTAMP_H
+#define __MBOX_X86_TIMESTAMP_H
+
+#include <mbox/base.h>
+
+static __always_inline u64 arch_timestamp(void)
+{
+	u32 lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return ((u64)hi << 32) | lo;
+}
+
+static __always_inline u64 arch_timestamp_ordered(void)
+{
+	u32 lo, hi;
+
+	asm volatile("lfence\n"
+		     "	rdtsc"
+		     : "=a" (lo), "=d" (hi) : : "memory");
+
+	return ((u64)hi << 32) | lo;
+}
+
+static __always_inline u64 arch_timestamp_freq(void)
+{
+	return 0;
+}
+
+#endif /* __MBOX_X86_TIMESTAMP_H */
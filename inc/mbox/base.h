@@ -38,8 +38,12 @@ typedef struct {
 #define __bitwise
 //#define __force		__attribute__((force))
 #define __force
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
 
 #define BITS_PER_LONG		64
+#define SMP_CACHE_BYTES		64
+#define ____cacheline_aligned	__attribute__((__aligned__(SMP_CACHE_BYTES)))
 #define __stringify(x)		#x
 #define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
 
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Bit operations. The double underscored variants aren't atomic and
+ * they're expected to be called with the lock held.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __MBOX_BITOPS_H
+#define __MBOX_BITOPS_H
+
+#include <mbox/base.h>
+#include <mbox/math.h>
+
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+#define BITMAP_FIRST_WORD_MASK(start)	(~0UL << ((start) & (BITS_PER_LONG - 1)))
+#define BITMAP_LAST_WORD_MASK(nbits)	(~0UL >> (-(nbits) & (BITS_PER_LONG - 1)))
+
+static inline bool test_bit(unsigned long nr, const unsigned long *addr)
+{
+	return addr[BIT_WORD(nr)] & BIT_MASK(nr);
+}
+
+static inline void __set_bit(unsigned long nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(unsigned long nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline bool __test_and_set_bit(unsigned long nr, unsigned long *addr)
+{
+	bool old = test_bit(nr, addr);
+
+	__set_bit(nr, addr);
+	return old;
+}
+
+static inline bool __test_and_clear_bit(unsigned long nr, unsigned long *addr)
+{
+	bool old = test_bit(nr, addr);
+
+	__clear_bit(nr, addr);
+	return old;
+}
+
+/* Returns @size if there is no set bit from @offset */
+static inline unsigned long find_next_bit(const unsigned long *addr,
+					  unsigned long size,
+					  unsigned long offset)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+
+	word = addr[BIT_WORD(offset)] & BITMAP_FIRST_WORD_MASK(offset);
+	offset = ALIGN_DOWN(offset, BITS_PER_LONG);
+	for (;;) {
+		if (word) {
+			offset += __ffs(word);
+			return offset < size ? offset : size;
+		}
+
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+
+		word = addr[BIT_WORD(offset)];
+	}
+}
+
+/* Returns @size if there is no clear bit from @offset */
+static inline unsigned long find_next_zero_bit(const unsigned long *addr,
+					       unsigned long size,
+					       unsigned long offset)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+
+	word = ~addr[BIT_WORD(offset)] & BITMAP_FIRST_WORD_MASK(offset);
+	offset = ALIGN_DOWN(offset, BITS_PER_LONG);
+	for (;;) {
+		if (word) {
+			offset += __ffs(word);
+			return offset < size ? offset : size;
+		}
+
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+
+		word = ~addr[BIT_WORD(offset)];
+	}
+}
+
+static inline bool bitmap_empty(const unsigned long *addr, unsigned int nbits)
+{
+	unsigned int i;
+
+	for (i = 0; i < nbits / BITS_PER_LONG; i++) {
+		if (addr[i])
+			return false;
+	}
+
+	if (nbits % BITS_PER_LONG)
+		return !(addr[i] & BITMAP_LAST_WORD_MASK(nbits));
+
+	return true;
+}
+
+static inline bool bitmap_full(const unsigned long *addr, unsigned int nbits)
+{
+	unsigned int i;
+
+	for (i = 0; i < nbits / BITS_PER_LONG; i++) {
+		if (~addr[i])
+			return false;
+	}
+
+	if (nbits % BITS_PER_LONG)
+		return !(~addr[i] & BITMAP_LAST_WORD_MASK(nbits));
+
+	return true;
+}
+
+static inline void bitmap_fill(unsigned long *addr, unsigned int nbits)
+{
+	unsigned int i;
+
+	for (i = 0; i < nbits / BITS_PER_LONG; i++)
+		addr[i] = ~0UL;
+
+	if (nbits % BITS_PER_LONG)
+		addr[i] = BITMAP_LAST_WORD_MASK(nbits);
+}
+
+static inline void bitmap_clear(unsigned long *addr, unsigned int start,
+				unsigned int nbits)
+{
+	while (nbits--)
+		__clear_bit(start++, addr);
+}
+
+#endif /* __MBOX_BITOPS_H */
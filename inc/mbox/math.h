@@ -46,5 +46,41 @@ static __always_inline unsigned long __ffs(unsigned long word)
 	return num;
 }
 
+/* Find last bit in word */
+static __always_inline unsigned long __fls(unsigned long word)
+{
+	int num = BITS_PER_LONG - 1;
+
+	if (!(word & (~0UL << 32))) {
+		num -= 32;
+		word <<= 32;
+	}
+
+	if (!(word & (~0UL << (BITS_PER_LONG - 16)))) {
+		num -= 16;
+		word <<= 16;
+	}
+
+	if (!(word & (~0UL << (BITS_PER_LONG - 8)))) {
+		num -= 8;
+		word <<= 8;
+	}
+
+	if (!(word & (~0UL << (BITS_PER_LONG - 4)))) {
+		num -= 4;
+		word <<= 4;
+	}
+
+	if (!(word & (~0UL << (BITS_PER_LONG - 2)))) {
+		num -= 2;
+		word <<= 2;
+	}
+
+	if (!(word & (~0UL << (BITS_PER_LONG - 1))))
+		num -= 1;
+
+	return num;
+}
+
 #endif /* __MBOX_MATH_H */
 
@@ -12,6 +12,7 @@
 #include <mbox/math.h>
 #include <mbox/atomic.h>
 #include <mbox/list.h>
+#include <mbox/timestamp.h>
 #include <mbox/xarray.h>
 
 #endif /* __MBOX_MBOX_H */
@@ -10,5 +10,6 @@
 
 /* lib */
 bool test_lib_xarray(void);
+bool test_lib_trace(void);
 
 #endif /* __MBOX_TEST_H */
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Timestamp functions. The timestamps are read from the cycle counter,
+ * which is much cheaper than clock_gettime(). timestamp() can be reordered
+ * with the surrounding instructions, while timestamp_ordered() can't. The
+ * counter frequency is calibrated against CLOCK_MONOTONIC at startup so
+ * that the ticks can be converted to nanoseconds.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __MBOX_TIMESTAMP_H
+#define __MBOX_TIMESTAMP_H
+
+#include <mbox/base.h>
+#if defined(__aarch64__)
+#include <asm/arm64/timestamp.h>
+#elif defined(__x86_64__)
+#include <asm/x86/timestamp.h>
+#else
+#error "Unsupported architecture"
+#endif
+
+#define NSEC_PER_SEC		1000000000ULL
+#define TIMESTAMP_SHIFT		32
+
+extern u64 timestamp_freq;	/* Ticks per second */
+extern u64 timestamp_mult;	/* Nanoseconds per tick << TIMESTAMP_SHIFT */
+
+static __always_inline u64 timestamp(void)
+{
+	return arch_timestamp();
+}
+
+static __always_inline u64 timestamp_ordered(void)
+{
+	return arch_timestamp_ordered();
+}
+
+static __always_inline u64 timestamp_to_ns(u64 ticks)
+{
+	return ((unsigned __int128)ticks * timestamp_mult) >> TIMESTAMP_SHIFT;
+}
+
+static __always_inline u64 timestamp_ns(void)
+{
+	return timestamp_to_ns(timestamp());
+}
+
+void timestamp_init(void);
+
+#endif /* __MBOX_TIMESTAMP_H */
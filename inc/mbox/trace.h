@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Event tracing. Every thread has its own ring buffer of fixed-size binary
+ * records, which is allocated on the first event from the thread. The
+ * records are written without any locks and the oldest ones are
+ * overwritten when the ring is full. The rings can be backed by files,
+ * which are merged by timestamp with tools/trace-dump. When the tracing
+ * is disabled, a tracepoint costs a single predictable branch.
+ *
+ * Author: Gavin Shan <shan.gavin@gmail.com>
+ */
+
+#ifndef __MBOX_TRACE_H
+#define __MBOX_TRACE_H
+
+#include <mbox/base.h>
+
+#define TRACE_ARGS		4
+#define TRACE_RING_SHIFT	14
+#define TRACE_RING_RECORDS	(1UL << TRACE_RING_SHIFT)
+#define TRACE_RING_MAGIC	0x54524352	/* "TRCR" */
+#define TRACE_MAX_THREADS	256
+
+enum trace_event_id {
+	TRACE_XAS_STORE,
+	TRACE_XAS_EXPAND,
+	TRACE_XAS_SHRINK,
+	TRACE_XAS_SPLIT,
+	TRACE_XAS_NOMEM,
+	TRACE_NR_EVENTS,
+};
+
+struct trace_record {
+	u64	ts;			/* Timestamp in ticks */
+	u32	id;			/* Event ID */
+	u32	tid;			/* Thread ID */
+	u64	args[TRACE_ARGS];	/* Arguments */
+};
+
+struct trace_ring {
+	u32			magic;
+	u32			tid;
+	u64			freq;	/* Timestamp ticks per second */
+	u64			head;	/* Records ever written */
+	u64			pad[5];
+	struct trace_record	records[TRACE_RING_RECORDS];
+};
+
+extern bool trace_enabled;
+
+void __trace_event(u32 id, const u64 *args);
+
+#define trace_event(id, ...)	do {					\
+	if (unlikely(READ_ONCE(trace_enabled)))				\
+		__trace_event(id, (const u64[TRACE_ARGS]){ __VA_ARGS__ });\
+} while (0)
+
+int trace_init(const char *dir);
+void trace_enable(void);
+void trace_disable(void);
+const char *trace_event_name(u32 id);
+int trace_merge(struct trace_ring **rings, int nr, FILE *fp);
+int trace_dump(FILE *fp);
+
+#endif /* __MBOX_TRACE_H */
@@ -26,11 +26,204 @@
 #define XA_FLAGS_ALLOC_WRAPPED	4U
 #define XA_FLAGS_ACCOUNT	8U
 #define XA_FLAGS_MARK(mark)	((1U << 4) << (mark))
+#define XA_FLAGS_HINT		128U	/* Per-thread lookup hint */
+#define XA_FLAGS_HUGE		256U	/* Nodes from huge page regions */
+#define XA_FLAGS_INLINE		512U	/* Inline entries until overflow */
+#define XA_FLAGS_COMPRESS	1024U	/* Skip the single child levels */
+#define XA_FLAGS_ADAPTIVE	2048U	/* Adaptive radix tree engine */
+#define XA_FLAGS_COALESCE	4096U	/* Coalesce the uniform nodes */
+#define XA_FLAGS_COUNT		8192U	/* Count the entries of the subtrees */
+#define XA_FLAGS_PACKED		16384U	/* Pack the small value leaves */
+#define XA_FLAGS_ALLOC		(XA_FLAGS_TRACK_FREE | XA_FLAGS_MARK(XA_FREE_MARK))
 
+/*
+ * The child node is prefetched on descent. The iteration also prefetches
+ * the subtree which is xa_prefetch_distance slots ahead of the one being
+ * visited. Zero disables the prefetching.
+ */
+#define XA_PREFETCH_DISTANCE	2
+
+extern unsigned int xa_prefetch_distance;
+
+/*
+ * The memory usage is accounted when XA_FLAGS_ACCOUNT is specified. The
+ * node allocation fails with -ENOMEM if the node bytes are going to exceed
+ * the budget, which is unlimited when it's zero. The mapped node regions
+ * of XA_FLAGS_HUGE are reported whether or not the memory is accounted.
+ */
+struct xa_account {
+	unsigned long	nr_nodes;	/* Allocated nodes */
+	unsigned long	nr_entries;	/* Stored entries */
+	unsigned long	node_bytes;	/* Bytes taken by the nodes */
+	unsigned long	budget;		/* Maximal node bytes */
+	unsigned long	nr_regions;	/* Mapped node regions */
+};
+
+/*
+ * The statistics are collected after xa_stats_enable() is called. The
+ * counters are kept in per-thread slots, which are summed up by
+ * xa_stats_read(). The latency histograms have log2 buckets of
+ * nanoseconds.
+ */
+enum xa_stat_item {
+	XA_STAT_LOAD,
+	XA_STAT_STORE,
+	XA_STAT_ERASE,
+	XA_STAT_RETRY,
+	XA_STAT_NOMEM,
+	XA_STAT_NODE_ALLOC,
+	XA_STAT_NODE_FREE,
+	XA_STAT_SHRINK,
+	XA_STAT_EXPAND,
+	XA_STAT_HINT,
+	XA_STAT_NR_ITEMS,
+};
+
+enum xa_stat_hist {
+	XA_HIST_LOAD,
+	XA_HIST_STORE,
+	XA_HIST_NR,
+};
+
+#define XA_STAT_BUCKETS		32
+
+struct xa_stats {
+	u64	items[XA_STAT_NR_ITEMS];
+	u64	hist[XA_HIST_NR][XA_STAT_BUCKETS];
+};
+
+struct xa_stats_slot;
+
+/*
+ * The lock profiling is enabled by xa_lock_stats_enable(). The wait and
+ * hold time are measured in nanoseconds and kept in log2 histograms.
+ * The hold time is also accumulated for every public API which takes
+ * the lock.
+ */
+#define XA_LOCK_BUCKETS		32
+#define XA_LOCK_APIS		32
+
+struct xa_lock_api {
+	const char	*name;		/* API name */
+	u64		count;		/* Acquisitions */
+	u64		total;		/* Total hold time */
+	u64		max;		/* Maximal hold time */
+};
+
+struct xa_lock_stats {
+	u64			acquired;
+	u64			contended;
+	u64			wait[XA_LOCK_BUCKETS];
+	u64			hold[XA_LOCK_BUCKETS];
+	struct xa_lock_api	apis[XA_LOCK_APIS];
+};
+
+struct xa_lock_prof;
+
+/*
+ * The calls to the public APIs are recorded by xa_record_start(). The
+ * records are written with the lock held, so that their order in the
+ * stream is the order in which the calls are applied. The stream starts
+ * with a header, which is followed by the records. The pointer entries
+ * are recorded as XA_RECORD_POINTER, while the value entries are kept.
+ */
+#define XA_RECORD_MAGIC		0x58415243	/* "XARC" */
+#define XA_RECORD_VERSION	1
+#define XA_RECORD_POINTER	2UL	/* Internal entry, never stored */
+
+enum xa_record_op {
+	XA_OP_LOAD,
+	XA_OP_STORE,
+	XA_OP_STORE_RANGE,
+	XA_OP_ERASE,
+	XA_OP_FIND,
+	XA_OP_FIND_AFTER,
+	XA_OP_GET_MARK,
+	XA_OP_SET_MARK,
+	XA_OP_CLEAR_MARK,
+	XA_OP_NR,
+};
+
+struct xa_record_header {
+	u32	magic;
+	u32	version;
+	u32	size;		/* Record size */
+	u32	flags;		/* Flags of the array */
+};
+
+struct xa_record {
+	u64	index;		/* Index or the first index of the range */
+	u64	last;		/* Last index of the range or the search */
+	u64	entry;		/* Entry stored */
+	u16	tid;		/* Thread */
+	u8	op;		/* enum xa_record_op */
+	u8	mark;		/* Mark or the search filter */
+	u32	pad;
+};
+
+struct xa_recorder;
+
+/*
+ * With XA_FLAGS_HUGE, the nodes are carved from 2MB regions backed by the
+ * huge pages, from hugetlbfs if it's available, otherwise from the
+ * transparent huge pages. The nodes are allocated from the heap when no
+ * region can be mapped. The empty regions are released to the system.
+ */
+struct xa_regions;
+
+/*
+ * With XA_FLAGS_INLINE, the array keeps up to XA_INLINE_SLOTS entries at
+ * arbitrary indexes in struct xarray, sorted by index, without any node.
+ * The entries are moved to the tree when one more entry is stored, or
+ * when something the inline entries can't represent is needed, like the
+ * marks, the multi-index entries and the advanced API. The array stays
+ * as a tree until it's destroyed. It's ignored by the allocating arrays.
+ */
+#define XA_INLINE_SLOTS		3
+#define XA_INLINE_TREE		(~0U)
+
+struct xa_inline {
+	unsigned long	index;
+	void		*entry;
+};
+
+/*
+ * With XA_FLAGS_PACKED, a leaf node whose entries are all values of up to
+ * XA_PACKED_MAX, as told by @nr_values, is replaced in the parent's slot
+ * by a packed leaf. It keeps a bitmap of the present slots, followed by
+ * the values in the fewest bits of 0, 1, 2, 4 or 8 which hold all of them,
+ * so a leaf of presence bits takes 4 bytes instead of a node. The packed
+ * leaf is expanded back into a node to be stored to. As with the adaptive
+ * arrays, only xa_load(), xa_store(), xa_erase(), the unmarked xa_find()
+ * and xa_find_after() and xa_count_range() are supported. The flag is
+ * ignored by the allocating, adaptive, compressing, coalescing and
+ * counting arrays.
+ */
+#define XA_PACKED_MAX		255UL
+
+/*
+ * With XA_FLAGS_ADAPTIVE, the entries are kept in an adaptive radix tree
+ * instead of the tree of struct xa_node. Every node dispatches on one byte
+ * of the index, and has 4, 16, 48 or 256 slots depending on how many
+ * children it has. It grows and shrinks with the occupancy. The levels
+ * which would have a single child are skipped. Only xa_load(), xa_store(),
+ * xa_erase() and the unmarked xa_find() and xa_find_after() are supported.
+ * There are no marks, multi-index entries, checkpoints or advanced API.
+ * The allocating arrays ignore the flag.
+ */
 struct xarray {
-	sem_t		sem;		/* Semaphore */
-	unsigned long	xa_flags;	/* Flags */
-	void		*xa_head;	/* Head node */
+	sem_t			sem;		/* Semaphore */
+	unsigned long		xa_flags;	/* Flags */
+	void			*xa_head;	/* Head node */
+	unsigned long		xa_gen;		/* Checkpoint generation */
+	unsigned long		xa_seq;		/* Changed on node free */
+	struct xa_account	xa_account;	/* Memory accounting */
+	struct xa_stats_slot	*xa_stats;	/* Per-thread statistics */
+	struct xa_lock_prof	*xa_lockprof;	/* Lock profiling */
+	struct xa_recorder	*xa_recorder;	/* API recorder */
+	struct xa_regions	*xa_regions;	/* Node regions */
+	unsigned int		xa_nr_inline;	/* Inline entries or XA_INLINE_TREE */
+	struct xa_inline	xa_inline[XA_INLINE_SLOTS];
 };
 
 typedef unsigned __bitwise xa_mark_t;
@@ -41,20 +234,60 @@ typedef unsigned __bitwise xa_mark_t;
 #define XA_MARK_MAX		XA_MARK_2
 #define XA_FREE_MARK		XA_MARK_0
 
+/*
+ * A mark expression is the truth table of the marks of an entry, whose
+ * bit n is set if the entry with the marks n matches. The tables of the
+ * marks are combined with &, | and ~, like
+ * XA_MARKS(XA_MARK_0) & ~XA_MARKS(XA_MARK_1).
+ */
+typedef unsigned int xa_marks_t;
+#define XA_MARKS(mark)	\
+	((0xf0ccaaU >> (8 * (__force unsigned int)(mark))) & 0xffU)
+
+/*
+ * The node is cache line aligned. The fields read on descent come first,
+ * so that the header shares the line with the first slots and a lookup
+ * touches one or two lines of the node. The fields used on updates and
+ * the upward walks follow the slots.
+ *
+ * With XA_FLAGS_COMPRESS, a node can be linked to a parent more than one
+ * level above it, skipping the levels which would have a single child.
+ * The node then covers only part of the parent's slot, starting from
+ * @index, and the lookups beyond it find nothing.
+ *
+ * With XA_FLAGS_COALESCE, a node whose slots all have the same entry and
+ * marks is replaced by the entry in the parent's slot, which becomes a
+ * multi-index entry. The entry is split back into a node when one of its
+ * indexes is stored or erased, so the stores and erases of single indexes
+ * never change the other indexes. The allocating arrays ignore the flag.
+ *
+ * xa_count_range() and xa_rank() count the indexes which have an entry,
+ * so a multi-index entry counts each of its indexes and every array with
+ * the same contents gives the same count. The count of the whole index
+ * space wraps to zero. With XA_FLAGS_COUNT, @total is the number of
+ * indexes in the subtree, which is kept by the nodes whose subtree can't
+ * exceed it. xa_count_range() adds up the subtrees within the range and
+ * only descends along its boundaries and through the wider nodes, and the
+ * other arrays are scanned. The counting arrays don't coalesce.
+ */
 struct xa_node {
 	unsigned char	shift;		/* Bits remaining in each slot */
 	unsigned char	offset;		/* Slot offset in parent */
 	unsigned char	count;		/* Total entry count */
 	unsigned char	nr_values;	/* Value entry count */
+	unsigned int	pooled:1;	/* Carved from a region */
+	unsigned int	total:31;	/* Indexes in the subtree */
+	unsigned long	index;		/* First index covered */
+	void		*slots[XA_CHUNK_SIZE];
 	struct xa_node	*parent;	/* NULL at top of tree */
 	struct xarray	*array;		/* The xarray it belongs to */
+	unsigned long	gen;		/* Generation of the last change */
 	/* struct list_head private_list */
-	void		*slots[XA_CHUNK_SIZE];
 	union {
 		unsigned long	tags[XA_MAX_MARKS][XA_MARK_LONGS];
 		unsigned long	marks[XA_MAX_MARKS][XA_MARK_LONGS];
 	};
-};
+} ____cacheline_aligned;
 
 typedef void (*xa_update_node_t)(struct xa_node *node);
 
@@ -121,6 +354,8 @@ static inline unsigned long xa_to_value(const void *entry)
 	return (unsigned long)entry >> 1;
 }
 
+#define BITS_PER_XA_VALUE	(BITS_PER_LONG - 1)
+
 static inline void *xa_mk_value(unsigned long v)
 {
 	return (void *)((v << 1) | 1);
@@ -310,6 +545,7 @@ static inline bool xas_retry(struct xa_state *xas, const void *entry)
 }
 
 /* Public APIs */
+void xa_init_flags(struct xarray *xa, unsigned long flags);
 void xa_init(struct xarray *xa);
 void *xa_load(struct xarray *xa, unsigned long index);
 void *xa_store(struct xarray *xa, unsigned long index, void *entry);
@@ -319,15 +555,45 @@ void *xa_find(struct xarray *xa, unsigned long *indexp,
 	      unsigned long max, xa_mark_t filter);
 void *xa_find_after(struct xarray *xa, unsigned long *indexp,
 		    unsigned long max, xa_mark_t filter);
+void *xa_find_marks(struct xarray *xa, unsigned long *indexp,
+		    unsigned long max, xa_marks_t expr);
+void *xa_find_marks_after(struct xarray *xa, unsigned long *indexp,
+			  unsigned long max, xa_marks_t expr);
 int xa_get_order(struct xarray *, unsigned long index);
+unsigned long xa_count_range(struct xarray *xa, unsigned long first,
+			     unsigned long last);
+unsigned long xa_rank(struct xarray *xa, unsigned long index);
 void *xa_erase(struct xarray *xa, unsigned long index);
 bool xa_get_mark(struct xarray *xa, unsigned long index, xa_mark_t mark);
 void xa_set_mark(struct xarray *xa, unsigned long index, xa_mark_t mark);
 void xa_clear_mark(struct xarray *xa, unsigned long index, xa_mark_t mark);
+void xa_set_mark_range(struct xarray *xa, unsigned long first,
+		       unsigned long last, xa_mark_t mark);
+void xa_clear_mark_range(struct xarray *xa, unsigned long first,
+			 unsigned long last, xa_mark_t mark);
+void xa_tag_marked_range(struct xarray *xa, unsigned long first,
+			 unsigned long last, xa_mark_t from, xa_mark_t to);
+void xa_set_budget(struct xarray *xa, unsigned long bytes);
+void xa_get_account(struct xarray *xa, struct xa_account *account);
+int xa_stats_enable(struct xarray *xa);
+void xa_stats_disable(struct xarray *xa);
+void xa_stats_read(struct xarray *xa, struct xa_stats *stats);
+int xa_lock_stats_enable(struct xarray *xa);
+void xa_lock_stats_disable(struct xarray *xa);
+void xa_lock_stats_read(struct xarray *xa, struct xa_lock_stats *stats);
+int xa_record_start(struct xarray *xa, FILE *fp);
+int xa_record_stop(struct xarray *xa);
+int xa_compact(struct xarray *xa, unsigned long *indexp);
+int xa_checkpoint(struct xarray *xa, FILE *fp);
+int xa_checkpoint_incremental(struct xarray *xa, FILE *fp);
+int xa_restore(struct xarray *xa, FILE *fp);
+int xa_build_sorted(struct xarray *xa, const unsigned long *indexes,
+		    void * const *entries, unsigned long nr,
+		    unsigned int threads);
+void xa_destroy(struct xarray *xa);
 #if 0
 unsigned int xa_extract(struct xarray *, void **dst, unsigned long start,
 			unsigned long max, unsigned int n, xa_mark_t);
-void xa_destroy(struct xarray *);
 #endif
 
 void *xas_load(struct xa_state *xas);
@@ -343,6 +609,7 @@ bool xas_get_mark(const struct xa_state *xas, xa_mark_t mark);
 void xas_set_mark(const struct xa_state *xas, xa_mark_t mark);
 void xas_clear_mark(const struct xa_state *xas, xa_mark_t mark);
 void *xas_find_marked(struct xa_state *xas, unsigned long max, xa_mark_t mark);
+void *xas_find_marks(struct xa_state *xas, unsigned long max, xa_marks_t expr);
 
 void xas_pause(struct xa_state *xas);
 bool xas_nomem(struct xa_state *xas);
@@ -351,4 +618,49 @@ void xas_destroy(struct xa_state *xas);
 #define xas_for_each_conflict(xas, entry) \
 	while ((entry = xas_find_conflict(xas)))
 
+/*
+ * IDA is the ID allocator on top of an allocating array. Every entry has
+ * the allocated bits of IDA_BITMAP_BITS IDs, in a value entry while they
+ * fit, or in a bitmap of 128 bytes otherwise. The free mark is cleared on
+ * the full bitmaps, which are skipped by the allocation. The memory taken
+ * is about one bit for every ID, plus the nodes above the entries.
+ */
+#define IDA_CHUNK_SIZE		128
+#define IDA_BITMAP_LONGS	(IDA_CHUNK_SIZE / sizeof(long))
+#define IDA_BITMAP_BITS		(IDA_BITMAP_LONGS * sizeof(long) * 8)
+
+struct ida_bitmap {
+	unsigned long	bitmap[IDA_BITMAP_LONGS];
+};
+
+struct ida {
+	struct xarray	xa;
+};
+
+void ida_init(struct ida *ida);
+int ida_alloc_range(struct ida *ida, unsigned int min, unsigned int max);
+void ida_free(struct ida *ida, unsigned int id);
+bool ida_exists(struct ida *ida, unsigned int id);
+void ida_destroy(struct ida *ida);
+
+static inline int ida_alloc(struct ida *ida)
+{
+	return ida_alloc_range(ida, 0, ~0);
+}
+
+static inline int ida_alloc_min(struct ida *ida, unsigned int min)
+{
+	return ida_alloc_range(ida, min, ~0);
+}
+
+static inline int ida_alloc_max(struct ida *ida, unsigned int max)
+{
+	return ida_alloc_range(ida, 0, max);
+}
+
+static inline bool ida_is_empty(const struct ida *ida)
+{
+	return !xa_head(&ida->xa);
+}
+
 #endif /* __MBOX_XARRAY_H */
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Timestamp
+ */
+
+#include <time.h>
+#include <mbox/timestamp.h>
+
+#define TIMESTAMP_CALIBRATE_NS	10000000ULL	/* 10ms */
+
+u64 timestamp_freq;
+u64 timestamp_mult;
+
+static u64 monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static u64 timestamp_calibrate(void)
+{
+	u64 start_ns, end_ns, start, end;
+
+	start_ns = monotonic_ns();
+	start = timestamp_ordered();
+	do {
+		end_ns = monotonic_ns();
+	} while (end_ns - start_ns < TIMESTAMP_CALIBRATE_NS);
+	end = timestamp_ordered();
+
+	return (end - start) * NSEC_PER_SEC / (end_ns - start_ns);
+}
+
+/*
+ * The frequency reported by the hardware is preferred. Otherwise, it's
+ * calibrated against CLOCK_MONOTONIC, which takes 10ms.
+ */
+void timestamp_init(void)
+{
+	u64 freq = arch_timestamp_freq();
+
+	if (!freq)
+		freq = timestamp_calibrate();
+	if (!freq)
+		freq = NSEC_PER_SEC;
+
+	timestamp_mult = (NSEC_PER_SEC << TIMESTAMP_SHIFT) / freq;
+	timestamp_freq = freq;
+}
+
+static void __attribute__((constructor)) timestamp_setup(void)
+{
+	timestamp_init();
+}
@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Event tracing
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <mbox/timestamp.h>
+#include <mbox/trace.h>
+
+bool trace_enabled;
+
+static const char *trace_event_names[TRACE_NR_EVENTS] = {
+	[TRACE_XAS_STORE]	= "xas_store",
+	[TRACE_XAS_EXPAND]	= "xas_expand",
+	[TRACE_XAS_SHRINK]	= "xas_shrink",
+	[TRACE_XAS_SPLIT]	= "xas_split",
+	[TRACE_XAS_NOMEM]	= "xas_nomem",
+};
+
+/* The registry is only locked when a ring is allocated or dumped */
+static struct {
+	sem_t			sem;
+	char			dir[PATH_MAX];
+	int			nr;
+	struct trace_ring	*rings[TRACE_MAX_THREADS];
+} trace_registry;
+
+static __thread struct trace_ring *trace_ring;
+static __thread bool trace_ring_failed;
+
+static void __attribute__((constructor)) trace_setup(void)
+{
+	sem_init(&trace_registry.sem, 0, 1);
+}
+
+static struct trace_ring *trace_ring_map(u32 tid)
+{
+	char path[PATH_MAX + 32];
+	struct trace_ring *ring;
+	size_t size = sizeof(*ring);
+	int fd = -1, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	if (trace_registry.dir[0]) {
+		snprintf(path, sizeof(path), "%s/trace.%d.%u",
+			 trace_registry.dir, getpid(), tid);
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return NULL;
+		if (ftruncate(fd, size)) {
+			close(fd);
+			return NULL;
+		}
+
+		flags = MAP_SHARED;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	ring->magic = TRACE_RING_MAGIC;
+	ring->tid = tid;
+	ring->freq = timestamp_freq;
+	ring->head = 0;
+
+	return ring;
+}
+
+static struct trace_ring *trace_ring_alloc(void)
+{
+	struct trace_ring *ring = NULL;
+
+	sem_wait(&trace_registry.sem);
+
+	if (trace_registry.nr < TRACE_MAX_THREADS) {
+		ring = trace_ring_map(syscall(SYS_gettid));
+		if (ring)
+			trace_registry.rings[trace_registry.nr++] = ring;
+	}
+
+	sem_post(&trace_registry.sem);
+
+	if (!ring)
+		trace_ring_failed = true;
+
+	return ring;
+}
+
+void __trace_event(u32 id, const u64 *args)
+{
+	struct trace_ring *ring = trace_ring;
+	struct trace_record *rec;
+	u64 head;
+
+	if (unlikely(!ring)) {
+		if (trace_ring_failed)
+			return;
+
+		ring = trace_ring = trace_ring_alloc();
+		if (!ring)
+			return;
+	}
+
+	head = ring->head;
+	rec = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+	rec->ts = timestamp();
+	rec->id = id;
+	rec->tid = ring->tid;
+	memcpy(rec->args, args, sizeof(rec->args));
+
+	/* Publish the record after it's filled */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The rings are backed by the files in @dir when it's specified, so that
+ * they survive the process. It has to be called before any event is
+ * traced.
+ */
+int trace_init(const char *dir)
+{
+	if (dir && strlen(dir) >= sizeof(trace_registry.dir))
+		return -ENAMETOOLONG;
+
+	sem_wait(&trace_registry.sem);
+	snprintf(trace_registry.dir, sizeof(trace_registry.dir),
+		 "%s", dir ? dir : "");
+	sem_post(&trace_registry.sem);
+
+	return 0;
+}
+
+void trace_enable(void)
+{
+	WRITE_ONCE(trace_enabled, true);
+}
+
+void trace_disable(void)
+{
+	WRITE_ONCE(trace_enabled, false);
+}
+
+const char *trace_event_name(u32 id)
+{
+	if (id >= TRACE_NR_EVENTS || !trace_event_names[id])
+		return "unknown";
+
+	return trace_event_names[id];
+}
+
+static u64 trace_ring_head(struct trace_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Merge the records from the rings by timestamp. The oldest slot of a full
+ * ring is the next one to be written, so its record isn't merged. The
+ * records which are overwritten while they're merged are reported as lost.
+ */
+int trace_merge(struct trace_ring **rings, int nr, FILE *fp)
+{
+	u64 *pos, *end, ts, lost = 0;
+	struct trace_record *rec, tmp;
+	struct trace_ring *ring;
+	int i, next;
+
+	pos = calloc(2 * nr, sizeof(*pos));
+	if (!pos)
+		return -ENOMEM;
+
+	end = pos + nr;
+	for (i = 0; i < nr; i++) {
+		end[i] = trace_ring_head(rings[i]);
+		if (end[i] >= TRACE_RING_RECORDS)
+			pos[i] = end[i] - TRACE_RING_RECORDS + 1;
+	}
+
+	for (;;) {
+		next = -1;
+		ts = 0;
+		for (i = 0; i < nr; i++) {
+			if (pos[i] == end[i])
+				continue;
+
+			rec = &rings[i]->records[pos[i] &
+						 (TRACE_RING_RECORDS - 1)];
+			if (next < 0 || rec->ts < ts) {
+				next = i;
+				ts = rec->ts;
+			}
+		}
+
+		if (next < 0)
+			break;
+
+		ring = rings[next];
+		tmp = ring->records[pos[next] & (TRACE_RING_RECORDS - 1)];
+
+		/*
+		 * The copy is done before the head is read again. The slot
+		 * might be filled when the head has moved a whole ring past
+		 * it, before the head is published.
+		 */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (trace_ring_head(ring) - pos[next] >= TRACE_RING_RECORDS) {
+			lost++;
+		} else {
+			ts = (unsigned __int128)tmp.ts * NSEC_PER_SEC /
+			     (ring->freq ? : NSEC_PER_SEC);
+			fprintf(fp, "%20llu %8u %-12s 0x%lx 0x%lx 0x%lx 0x%lx\n",
+				(unsigned long long)ts,
+				tmp.tid, trace_event_name(tmp.id),
+				tmp.args[0], tmp.args[1],
+				tmp.args[2], tmp.args[3]);
+		}
+
+		pos[next]++;
+	}
+
+	if (lost)
+		fprintf(fp, "# %llu records lost\n", (unsigned long long)lost);
+
+	free(pos);
+	return 0;
+}
+
+int trace_dump(FILE *fp)
+{
+	int ret;
+
+	sem_wait(&trace_registry.sem);
+	ret = trace_merge(trace_registry.rings, trace_registry.nr, fp);
+	sem_post(&trace_registry.sem);
+
+	return ret;
+}
@@ -1,25 +1,245 @@
 /* SPDX-License-Identifier: GPL-2.0+ */
 /*
  * eXtensible Array
- *
- * FIXME:
- * a) Support test_bit() and its variant;
  */
 
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <mbox/bitops.h>
+#include <mbox/list.h>
+#include <mbox/timestamp.h>
+#include <mbox/trace.h>
 #include <mbox/xarray.h>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
 /************************* Helpers ************************/
 
-static inline void xa_lock(struct xarray *xa)
+unsigned int xa_prefetch_distance = XA_PREFETCH_DISTANCE;
+
+static inline unsigned int log2_bucket(u64 val, unsigned int nr)
+{
+	unsigned int bucket = val ? BITS_PER_LONG - __builtin_clzl(val) : 0;
+
+	return bucket < nr ? bucket : nr - 1;
+}
+
+/*
+ * The lock profiling data is updated with the lock held, except the
+ * waiting time which is accounted after the lock is acquired.
+ */
+struct xa_lock_prof {
+	struct xa_lock_stats	stats;
+	const char		*holder;	/* API holding the lock */
+	u64			start;		/* Acquisition timestamp */
+};
+
+static void xa_lock_profiled(struct xarray *xa, struct xa_lock_prof *prof,
+			     const char *func)
+{
+	struct xa_lock_stats *stats = &prof->stats;
+	u64 start, now;
+
+	if (sem_trywait(&xa->sem)) {
+		start = timestamp();
+		sem_wait(&xa->sem);
+		now = timestamp();
+		stats->contended++;
+		stats->wait[log2_bucket(timestamp_to_ns(now - start),
+					XA_LOCK_BUCKETS)]++;
+	} else {
+		now = timestamp();
+		stats->wait[0]++;
+	}
+
+	stats->acquired++;
+	prof->holder = func;
+	prof->start = now;
+}
+
+static void xa_unlock_profiled(struct xa_lock_prof *prof)
+{
+	struct xa_lock_stats *stats = &prof->stats;
+	struct xa_lock_api *api;
+	u64 hold = timestamp_to_ns(timestamp() - prof->start);
+	unsigned int i;
+
+	stats->hold[log2_bucket(hold, XA_LOCK_BUCKETS)]++;
+	for (i = 0; i < XA_LOCK_APIS; i++) {
+		api = &stats->apis[i];
+		if (api->name == prof->holder || !api->name)
+			break;
+	}
+
+	if (i < XA_LOCK_APIS) {
+		api->name = prof->holder;
+		api->count++;
+		api->total += hold;
+		if (hold > api->max)
+			api->max = hold;
+	}
+
+	prof->holder = NULL;
+}
+
+static inline void __xa_lock(struct xarray *xa, const char *func)
 {
-	sem_wait(&xa->sem);
+	struct xa_lock_prof *prof = READ_ONCE(xa->xa_lockprof);
+
+	if (prof)
+		xa_lock_profiled(xa, prof, func);
+	else
+		sem_wait(&xa->sem);
 }
 
 static inline void xa_unlock(struct xarray *xa)
 {
+	struct xa_lock_prof *prof = xa->xa_lockprof;
+
+	if (prof && prof->holder)
+		xa_unlock_profiled(prof);
+
 	sem_post(&xa->sem);
 }
 
+/*
+ * The lock is held on behalf of the API calling xa_lock(). The helpers
+ * shared by several APIs take the name of their caller, and pass it to
+ * __xa_lock() instead.
+ */
+#define xa_lock(xa)	__xa_lock(xa, __func__)
+
+/*
+ * The statistics slots are assigned to the threads in round-robin. The
+ * threads beyond XA_STATS_SLOTS share the slots, where the atomic updates
+ * keep the counters precise at the cost of the cache line bouncing.
+ */
+#define XA_STATS_SLOTS		32
+
+struct xa_stats_slot {
+	u64		items[XA_STAT_NR_ITEMS];
+	u64		hist[XA_HIST_NR][XA_STAT_BUCKETS];
+} ____cacheline_aligned;
+
+static unsigned int xa_stats_next;
+static __thread int xa_stats_id = -1;
+
+static struct xa_stats_slot *xa_stats_slot(struct xa_stats_slot *stats)
+{
+	if (xa_stats_id < 0) {
+		xa_stats_id = __atomic_fetch_add(&xa_stats_next, 1,
+						 __ATOMIC_RELAXED) %
+			      XA_STATS_SLOTS;
+	}
+
+	return &stats[xa_stats_id];
+}
+
+static inline void xa_stat_inc(struct xarray *xa, enum xa_stat_item item)
+{
+	struct xa_stats_slot *stats = READ_ONCE(xa->xa_stats);
+
+	if (stats)
+		__atomic_fetch_add(&xa_stats_slot(stats)->items[item], 1,
+				   __ATOMIC_RELAXED);
+}
+
+static inline u64 xa_stat_start(struct xarray *xa)
+{
+	return READ_ONCE(xa->xa_stats) ? timestamp() : 0;
+}
+
+static void xa_stat_time(struct xarray *xa, enum xa_stat_hist hist,
+			 u64 start)
+{
+	struct xa_stats_slot *stats = READ_ONCE(xa->xa_stats);
+	unsigned int bucket;
+	u64 delta;
+
+	if (!stats || !start)
+		return;
+
+	delta = timestamp_to_ns(timestamp() - start);
+	bucket = log2_bucket(delta, XA_STAT_BUCKETS);
+	__atomic_fetch_add(&xa_stats_slot(stats)->hist[hist][bucket], 1,
+			   __ATOMIC_RELAXED);
+}
+
+static inline bool xa_retry(struct xa_state *xas, const void *entry)
+{
+	if (xa_is_retry(entry))
+		xa_stat_inc(xas->xa, XA_STAT_RETRY);
+
+	return xas_retry(xas, entry);
+}
+
+/*
+ * The records are buffered and flushed to the stream when the buffer is
+ * full. Both are done with the lock held, so no extra lock is needed.
+ */
+#define XA_RECORD_BATCH		4096
+
+struct xa_recorder {
+	FILE			*fp;
+	int			err;
+	unsigned int		nr;
+	struct xa_record	records[XA_RECORD_BATCH];
+};
+
+static int xa_record_next;
+static __thread int xa_record_tid = -1;
+
+static int xa_recorder_flush(struct xa_recorder *rec)
+{
+	if (rec->nr && !rec->err &&
+	    fwrite(rec->records, sizeof(*rec->records),
+		   rec->nr, rec->fp) != rec->nr)
+		rec->err = -EIO;
+
+	rec->nr = 0;
+	return rec->err;
+}
+
+static void __xa_record(struct xa_recorder *rec, enum xa_record_op op,
+			unsigned long index, unsigned long last,
+			const void *entry, xa_mark_t mark)
+{
+	struct xa_record *r;
+
+	if (xa_record_tid < 0)
+		xa_record_tid = __atomic_fetch_add(&xa_record_next, 1,
+						   __ATOMIC_RELAXED);
+
+	if (rec->nr == XA_RECORD_BATCH)
+		xa_recorder_flush(rec);
+
+	r = &rec->records[rec->nr++];
+	r->index = index;
+	r->last = last;
+	if (!entry || xa_is_zero(entry))
+		r->entry = 0;
+	else if (xa_is_value(entry))
+		r->entry = (unsigned long)entry;
+	else
+		r->entry = XA_RECORD_POINTER;
+	r->tid = xa_record_tid;
+	r->op = op;
+	r->mark = (__force unsigned int)mark;
+	r->pad = 0;
+}
+
+static inline void xa_record(struct xarray *xa, enum xa_record_op op,
+			     unsigned long index, unsigned long last,
+			     const void *entry, xa_mark_t mark)
+{
+	if (unlikely(xa->xa_recorder))
+		__xa_record(xa->xa_recorder, op, index, last, entry, mark);
+}
+
 static inline bool xa_track_free(const struct xarray *xa)
 {
 	return xa->xa_flags & XA_FLAGS_TRACK_FREE;
@@ -30,6 +250,145 @@ static inline bool xa_zero_busy(const struct xarray *xa)
 	return xa->xa_flags & XA_FLAGS_ZERO_BUSY;
 }
 
+static inline bool xa_accounted(const struct xarray *xa)
+{
+	return xa->xa_flags & XA_FLAGS_ACCOUNT;
+}
+
+static inline bool xa_hinted(const struct xarray *xa)
+{
+	return xa->xa_flags & XA_FLAGS_HINT;
+}
+
+/* The free marks can't tell the free indexes beside a compressed node */
+static inline bool xa_compressed(const struct xarray *xa)
+{
+	return (xa->xa_flags & XA_FLAGS_COMPRESS) && !xa_track_free(xa);
+}
+
+static inline bool xa_adaptive(const struct xarray *xa)
+{
+	return (xa->xa_flags & XA_FLAGS_ADAPTIVE) && !xa_track_free(xa);
+}
+
+static inline bool xa_counted(const struct xarray *xa)
+{
+	return xa->xa_flags & XA_FLAGS_COUNT;
+}
+
+static inline bool xa_coalesced(const struct xarray *xa)
+{
+	return (xa->xa_flags & XA_FLAGS_COALESCE) && !xa_track_free(xa) &&
+	       !xa_counted(xa);
+}
+
+/* The packed leaves are told apart from the entries by their slots */
+static inline bool xa_packed(const struct xarray *xa)
+{
+	return (xa->xa_flags & XA_FLAGS_PACKED) && !xa_track_free(xa) &&
+	       !(xa->xa_flags & (XA_FLAGS_ADAPTIVE | XA_FLAGS_COMPRESS |
+				 XA_FLAGS_COALESCE | XA_FLAGS_COUNT));
+}
+
+static inline bool xa_inlined(const struct xarray *xa)
+{
+	return xa->xa_nr_inline != XA_INLINE_TREE;
+}
+
+static int xa_inline_promote(struct xarray *xa);
+
+/*
+ * The node which is last looked up by the thread. It's trusted only if
+ * no node has been freed from the array since then, which is told by
+ * the sequence. The sequences are unique among the arrays, so that the
+ * hint doesn't match an array reinitialized at the same address.
+ */
+struct xa_hint {
+	const struct xarray	*xa;
+	struct xa_node		*node;
+	unsigned long		seq;
+	unsigned long		index;	/* Index covered by the node */
+};
+
+static unsigned long xa_seq_next;
+static __thread struct xa_hint xa_hint;
+
+static inline void xa_seq_bump(struct xarray *xa)
+{
+	xa->xa_seq = __atomic_add_fetch(&xa_seq_next, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool __xa_over_budget(const struct xarray *xa, size_t size)
+{
+	const struct xa_account *account = &xa->xa_account;
+
+	if (!xa_accounted(xa) || !account->budget)
+		return false;
+
+	return account->node_bytes + size > account->budget;
+}
+
+static inline bool xa_over_budget(const struct xarray *xa)
+{
+	return __xa_over_budget(xa, sizeof(struct xa_node));
+}
+
+/* The internal entries, including the zero entry, aren't accounted */
+static inline void xa_account_entries(struct xarray *xa, long nr)
+{
+	if (xa_accounted(xa))
+		xa->xa_account.nr_entries += nr;
+}
+
+static inline bool entry_accounted(const void *entry)
+{
+	return entry && !xa_is_internal(entry);
+}
+
+static inline void __xa_account_node(struct xarray *xa, long nr, size_t size)
+{
+	if (!xa_accounted(xa))
+		return;
+
+	xa->xa_account.nr_nodes += nr;
+	xa->xa_account.node_bytes += nr * (long)size;
+}
+
+static inline void xa_account_node(struct xarray *xa, long nr)
+{
+	__xa_account_node(xa, nr, sizeof(struct xa_node));
+}
+
+/*
+ * The values of the packed leaf are kept in @width bits each, in the order
+ * of their slots. The bits of the absent slots are zero.
+ */
+struct xa_packed {
+	u16	present;	/* Slots with a value */
+	u8	width;		/* Bits of every value */
+	u8	bits[];		/* Packed values */
+};
+
+static inline size_t xa_packed_size(unsigned int width)
+{
+	return sizeof(struct xa_packed) + XA_CHUNK_SIZE * width / 8;
+}
+
+/* A packed array has no other pointer in the slots above the leaves */
+static inline bool xa_is_packed(const struct xarray *xa,
+				const struct xa_node *node, const void *entry)
+{
+	return xa_packed(xa) && node->shift && entry &&
+	       !xa_is_internal(entry) && !xa_is_value(entry);
+}
+
+static void xa_packed_free(struct xarray *xa, struct xa_packed *packed)
+{
+	xa_stat_inc(xa, XA_STAT_NODE_FREE);
+	__xa_account_node(xa, -1, xa_packed_size(packed->width));
+	free(packed);
+}
+
 static inline bool xa_marked(const struct xarray *xa, xa_mark_t mark)
 {
 	return xa->xa_flags & XA_FLAGS_MARK(mark);
@@ -55,33 +414,29 @@ static inline unsigned long *node_marks(struct xa_node *node, xa_mark_t mark)
 static inline bool node_get_mark(struct xa_node *node,
 				 unsigned int offset, xa_mark_t mark)
 {
-	// return test_bit(offset, node_marks(node, mark));
-	return false;
+	return test_bit(offset, node_marks(node, mark));
 }
 
 static inline bool node_set_mark(struct xa_node *node,
 				 unsigned int offset, xa_mark_t mark)
 {
-	// return __test_and_set_bit(offset, node_marks(node, mark));
-	return false;
+	return __test_and_set_bit(offset, node_marks(node, mark));
 }
 
 static inline bool node_clear_mark(struct xa_node *node,
 				   unsigned int offset, xa_mark_t mark)
 {
-	// return __test_and_clear_bit(offset, node_marks(node, mark));
-	return true;
+	return __test_and_clear_bit(offset, node_marks(node, mark));
 }
 
 static inline bool node_any_mark(struct xa_node *node, xa_mark_t mark)
 {
-	// return !bitmap_empty(node_marks(node, mark), XA_CHUNK_SIZE);
-	return false;
+	return !bitmap_empty(node_marks(node, mark), XA_CHUNK_SIZE);
 }
 
 static inline void node_mark_all(struct xa_node *node, xa_mark_t mark)
 {
-	// bitmap_fill(node_marks(node, mark), XA_CHUNK_SIZE);
+	bitmap_fill(node_marks(node, mark), XA_CHUNK_SIZE);
 }
 
 #define mark_inc(mark) do { \
@@ -121,14 +476,291 @@ static void node_set_marks(struct xa_node *node, unsigned int offset,
 	}
 }
 
+/*
+ * The regions are aligned to their size, so that the region of a node is
+ * found by masking its address. The nodes are handed out from the unused
+ * tail of the region or its free list. When a region becomes empty, its
+ * pages are released. One empty region is kept for reuse and the others
+ * are unmapped. The hugetlb pages can't be released in part, so the empty
+ * regions backed by them are always unmapped.
+ */
+#define XA_REGION_SIZE		(2UL << 20)
+#define XA_REGION_NODES		((XA_REGION_SIZE - sizeof(struct xa_region)) / \
+				 sizeof(struct xa_node))
+
+struct xa_region {
+	struct list_head	link;		/* In the available list */
+	unsigned long		nr_used;	/* Allocated nodes */
+	unsigned long		nr_fresh;	/* Nodes ever carved */
+	struct xa_node		*free;		/* Freed nodes */
+	bool			hugetlb;	/* Backed by hugetlbfs */
+	struct xa_node		nodes[];
+} ____cacheline_aligned;
+
+struct xa_regions {
+	sem_t			sem;
+	struct list_head	avail;		/* Regions with free nodes */
+	struct xa_region	*empty;		/* Empty region kept */
+	struct xa_region	*target;	/* Compaction target */
+	unsigned long		nr_regions;
+};
+
+static inline bool xa_huge(const struct xarray *xa)
+{
+	return xa->xa_flags & XA_FLAGS_HUGE;
+}
+
+static struct xa_region *xa_region_map(bool *hugetlb)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned long addr, aligned;
+	void *p;
+
+#ifdef MAP_HUGETLB
+#ifdef MAP_HUGE_2MB
+	p = mmap(NULL, XA_REGION_SIZE, PROT_READ | PROT_WRITE,
+		 flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+#else
+	p = mmap(NULL, XA_REGION_SIZE, PROT_READ | PROT_WRITE,
+		 flags | MAP_HUGETLB, -1, 0);
+#endif
+	if (p != MAP_FAILED) {
+		*hugetlb = true;
+		return p;
+	}
+#endif
+
+	*hugetlb = false;
+
+	/* Map twice the size and trim it to the aligned region */
+	p = mmap(NULL, 2 * XA_REGION_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	addr = (unsigned long)p;
+	aligned = ALIGN_UP(addr, XA_REGION_SIZE);
+	if (aligned > addr)
+		munmap(p, aligned - addr);
+	munmap((void *)(aligned + XA_REGION_SIZE),
+	       addr + XA_REGION_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise((void *)aligned, XA_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	return (struct xa_region *)aligned;
+}
+
+static struct xa_regions *xa_regions_get(struct xarray *xa)
+{
+	struct xa_regions *regions = READ_ONCE(xa->xa_regions), *curr = NULL;
+
+	if (regions)
+		return regions;
+
+	regions = calloc(1, sizeof(*regions));
+	if (!regions)
+		return NULL;
+
+	sem_init(&regions->sem, 0, 1);
+	INIT_LIST_HEAD(&regions->avail);
+	if (!__atomic_compare_exchange_n(&xa->xa_regions, &curr, regions, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		sem_destroy(&regions->sem);
+		free(regions);
+	}
+
+	return READ_ONCE(xa->xa_regions);
+}
+
+static struct xa_region *xa_region_new(struct xa_regions *regions)
+{
+	struct xa_region *region;
+	bool hugetlb;
+
+	region = xa_region_map(&hugetlb);
+	if (!region)
+		return NULL;
+
+	region->hugetlb = hugetlb;
+
+	region->nr_used = 0;
+	region->nr_fresh = 0;
+	region->free = NULL;
+	list_add(&regions->avail, &region->link);
+	regions->nr_regions++;
+
+	return region;
+}
+
+static struct xa_node *xa_region_alloc(struct xarray *xa)
+{
+	struct xa_regions *regions = xa_regions_get(xa);
+	struct xa_region *region;
+	struct xa_node *node = NULL;
+
+	if (!regions)
+		return NULL;
+
+	sem_wait(&regions->sem);
+
+	if (list_empty(&regions->avail) && !xa_region_new(regions))
+		goto out;
+
+	region = list_entry(regions->avail.next, struct xa_region, link);
+	if (region == regions->empty)
+		regions->empty = NULL;
+
+	if (region->free) {
+		node = region->free;
+		region->free = node->parent;
+	} else {
+		node = &region->nodes[region->nr_fresh++];
+	}
+
+	if (++region->nr_used == XA_REGION_NODES)
+		list_del(&region->link);
+out:
+	sem_post(&regions->sem);
+	return node;
+}
+
+static void xa_region_free(struct xarray *xa, struct xa_node *node)
+{
+	struct xa_regions *regions = xa->xa_regions;
+	struct xa_region *region;
+	unsigned long start;
+
+	region = (struct xa_region *)((unsigned long)node &
+				      ~(XA_REGION_SIZE - 1));
+
+	sem_wait(&regions->sem);
+
+	if (region->nr_used-- == XA_REGION_NODES)
+		list_add(&regions->avail, &region->link);
+
+	node->parent = region->free;
+	region->free = node;
+	if (region->nr_used)
+		goto out;
+
+	if (region == regions->target)
+		regions->target = NULL;
+
+	/* The pages after the one of the header are released */
+	start = ALIGN_UP((unsigned long)region->nodes, sysconf(_SC_PAGESIZE));
+	if (!regions->empty && !region->hugetlb &&
+	    !madvise((void *)start, (unsigned long)region + XA_REGION_SIZE - start,
+		     MADV_DONTNEED)) {
+		region->free = NULL;
+		region->nr_fresh = 0;
+		regions->empty = region;
+		goto out;
+	}
+
+	list_del(&region->link);
+	munmap(region, XA_REGION_SIZE);
+	regions->nr_regions--;
+out:
+	sem_post(&regions->sem);
+}
+
+/*
+ * Carve a node from the unused tail of the compaction target, so that
+ * the nodes carved in a row are contiguous.
+ */
+static struct xa_node *xa_region_carve(struct xarray *xa)
+{
+	struct xa_regions *regions = xa_regions_get(xa);
+	struct xa_region *region;
+	struct xa_node *node = NULL;
+
+	if (!regions)
+		return NULL;
+
+	sem_wait(&regions->sem);
+
+	region = regions->target;
+	if (!region || region->nr_fresh == XA_REGION_NODES) {
+		region = xa_region_new(regions);
+		if (!region)
+			goto out;
+
+		regions->target = region;
+	}
+
+	if (region == regions->empty)
+		regions->empty = NULL;
+
+	node = &region->nodes[region->nr_fresh++];
+	if (++region->nr_used == XA_REGION_NODES)
+		list_del(&region->link);
+out:
+	sem_post(&regions->sem);
+	return node;
+}
+
+/* Unmap the regions when no nodes are left */
+static void xa_regions_release(struct xarray *xa)
+{
+	struct xa_regions *regions = xa->xa_regions;
+
+	if (!regions || regions->nr_regions > 1 ||
+	    (regions->nr_regions && !regions->empty))
+		return;
+
+	if (regions->empty) {
+		list_del(&regions->empty->link);
+		munmap(regions->empty, XA_REGION_SIZE);
+	}
+
+	sem_destroy(&regions->sem);
+	free(regions);
+	xa->xa_regions = NULL;
+}
+
+static struct xa_node *xa_node_alloc(struct xarray *xa)
+{
+	struct xa_node *node = NULL;
+
+	if (xa_huge(xa))
+		node = xa_region_alloc(xa);
+
+	if (node) {
+		memset(node, 0, sizeof(*node));
+		node->pooled = 1;
+		return node;
+	}
+
+	if (posix_memalign((void **)&node, SMP_CACHE_BYTES, sizeof(*node)))
+		return NULL;
+
+	memset(node, 0, sizeof(*node));
+	return node;
+}
+
+/* Release the memory of a node, which might have never been accounted */
+static void xa_node_release(struct xarray *xa, struct xa_node *node)
+{
+	if (node->pooled)
+		xa_region_free(xa, node);
+	else
+		free(node);
+}
+
 static void xa_node_free(struct xa_node *node)
 {
-	free(node);
+	struct xarray *xa = node->array;
+
+	if (xa_hinted(xa))
+		xa_seq_bump(xa);
+
+	xa_stat_inc(xa, XA_STAT_NODE_FREE);
+	xa_account_node(xa, -1);
+	xa_node_release(xa, node);
 }
 
 static void xas_squash_marks(const struct xa_state *xas)
 {
-#if 0 /* TODO */
 	unsigned int mark = 0;
 	unsigned int limit = xas->xa_offset + xas->xa_sibs + 1;
 	unsigned long *marks;
@@ -142,9 +774,8 @@ static void xas_squash_marks(const struct xa_state *xas)
 			continue;
 
 		__set_bit(xas->xa_offset, marks);
-                bitmap_clear(marks, xas->xa_offset + 1, xas->xa_sibs);
-        } while (mark++ != (__force unsigned)XA_MARK_MAX);
-#endif
+		bitmap_clear(marks, xas->xa_offset + 1, xas->xa_sibs);
+	} while (mark++ != (__force unsigned)XA_MARK_MAX);
 }
 
 static inline unsigned int get_offset(struct xa_node *node,
@@ -153,6 +784,17 @@ static inline unsigned int get_offset(struct xa_node *node,
 	return (index >> node->shift) & XA_CHUNK_MASK;
 }
 
+/* The first index covered by the node of @shift, which covers @index */
+static inline unsigned long node_base(unsigned long index, unsigned int shift)
+{
+	return index & ~((XA_CHUNK_SIZE << shift) - 1);
+}
+
+static inline bool node_covers(const struct xa_node *node, unsigned long index)
+{
+	return ((index - node->index) >> node->shift) <= XA_CHUNK_MASK;
+}
+
 static inline void *set_bounds(struct xa_state *xas)
 {
 	xas->xa_node = XAS_BOUNDS;
@@ -200,7 +842,19 @@ static void xas_move_index(struct xa_state *xas, unsigned long offset)
 	xas->xa_index += offset << shift;
 }
 
-static void xas_next_offset(struct xa_state *xas)
+/*
+ * Move the index to the start of the slot after the iteration climbs up,
+ * as the child can be a compressed node which ends before the slot does.
+ */
+static void xas_slot_index(struct xa_state *xas)
+{
+	struct xa_node *node = xas->xa_node;
+
+	xas->xa_index = node->index + ((unsigned long)xas->xa_offset <<
+				       node->shift);
+}
+
+static void xas_next_offset(struct xa_state *xas)
 {
 	xas->xa_offset++;
 	xas_move_index(xas, xas->xa_offset);
@@ -225,8 +879,44 @@ static unsigned int xas_find_chunk(struct xa_state *xas,
 		return XA_CHUNK_SIZE;
 	}
 
-	// return find_next_bit(addr, XA_CHUNK_SIZE, offset);
-	return offset;
+	return find_next_bit(addr, XA_CHUNK_SIZE, offset);
+}
+
+/*
+ * The slots which may lead to an entry matching @expr. The mark of a slot
+ * leading to a node only tells that one of its entries has the mark, so
+ * the cleared marks don't prune the subtrees. The entries found are
+ * checked against the whole expression.
+ */
+static unsigned int xas_find_chunk_marks(struct xa_state *xas,
+					 bool advance, xa_marks_t expr)
+{
+	struct xa_node *node = xas->xa_node;
+	unsigned int offset = xas->xa_offset, marks, i;
+	unsigned long data = 0, term;
+
+	for (marks = 0; marks < 1U << XA_MAX_MARKS; marks++) {
+		if (!(expr & (1U << marks)))
+			continue;
+
+		term = ~0UL;
+		for (i = 0; i < XA_MAX_MARKS; i++) {
+			if (marks & (1U << i))
+				term &= node->marks[i][0];
+		}
+		data |= term;
+	}
+
+	if (advance)
+		offset++;
+	data &= ~0UL >> (BITS_PER_LONG - XA_CHUNK_SIZE);
+	if (offset < XA_CHUNK_SIZE) {
+		data &= ~0UL << offset;
+		if (data)
+			return __ffs(data);
+	}
+
+	return XA_CHUNK_SIZE;
 }
 
 static bool xas_is_sibling(struct xa_state *xas)
@@ -253,8 +943,24 @@ static void *xas_result(struct xa_state *xas, void *curr)
 	return curr;
 }
 
+/*
+ * Stamp the node and its ancestors with the current checkpoint generation.
+ * The ancestors of a stamped node are always stamped, so the walk stops at
+ * the first node which has been stamped in this generation.
+ */
+static void xas_dirty(struct xa_state *xas, struct xa_node *node)
+{
+	unsigned long gen = xas->xa->xa_gen;
+
+	while (node && node->gen != gen) {
+		node->gen = gen;
+		node = xa_parent(xas->xa, node);
+	}
+}
+
 static void xas_update(struct xa_state *xas, struct xa_node *node)
 {
+	xas_dirty(xas, node);
 	if (xas->xa_update)
 		xas->xa_update(node);
 }
@@ -290,10 +996,18 @@ bool xas_nomem(struct xa_state *xas)
 		return false;
 	}
 
-	xas->xa_alloc = (struct xa_node *)malloc(sizeof(struct xa_node));
+	/* Let the caller evict something before retrying */
+	if (xa_over_budget(xas->xa)) {
+		xas_destroy(xas);
+		return false;
+	}
+
+	xas->xa_alloc = xa_node_alloc(xas->xa);
 	if (!xas->xa_alloc)
 		return false;
 
+	xa_stat_inc(xas->xa, XA_STAT_NOMEM);
+	trace_event(TRACE_XAS_NOMEM, xas->xa_index, xas->xa_shift);
 	xas->xa_alloc->parent = NULL;
 	xas->xa_node = XAS_RESTART;
 	return true;
@@ -305,7 +1019,7 @@ void xas_destroy(struct xa_state *xas)
 
 	while (node) {
 		next = node->parent;
-		free(node);
+		xa_node_release(xas->xa, node);
 		xas->xa_alloc = node = next;
         }
 }
@@ -324,6 +1038,8 @@ static void xas_shrink(struct xa_state *xas)
 			break;
 		if (!xa_is_node(entry) && node->shift)
 			break;
+		if (xa_is_node(entry) && xa_to_node(entry)->index)
+			break;
 		if (xa_is_zero(entry) && xa_zero_busy(xa))
 			entry = NULL;
 		xas->xa_node = XAS_BOUNDS;
@@ -337,7 +1053,9 @@ static void xas_shrink(struct xa_state *xas)
 		if (!xa_is_node(entry))
 			node->slots[0] = XA_RETRY_ENTRY;
 		xas_update(xas, node);
+		trace_event(TRACE_XAS_SHRINK, (u64)node, node->shift);
 		xa_node_free(node);
+		xa_stat_inc(xa, XA_STAT_SHRINK);
 		if (!xa_is_node(entry))
 			break;
 		node = xa_to_node(entry);
@@ -345,6 +1063,42 @@ static void xas_shrink(struct xa_state *xas)
 	}
 }
 
+/*
+ * Replace the node with its only child if the child is a node, which is
+ * linked to the parent as a compressed node. The position is restarted
+ * as the node is gone.
+ */
+static void xas_collapse(struct xa_state *xas, struct xa_node *node)
+{
+	struct xa_node *child, *parent = xa_parent(xas->xa, node);
+	unsigned int offset;
+	void *entry = NULL;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		entry = xa_entry(xas->xa, node, offset);
+		if (entry)
+			break;
+	}
+
+	if (!node->shift || !xa_is_node(entry))
+		return;
+
+	child = xa_to_node(entry);
+	child->parent = parent;
+	child->offset = node->offset;
+	parent->slots[node->offset] = entry;
+
+	node->count = 0;
+	xas_update(xas, node);
+	trace_event(TRACE_XAS_SHRINK, (u64)node, node->shift);
+	xa_node_free(node);
+	xa_stat_inc(xas->xa, XA_STAT_SHRINK);
+
+	/* The checkpoint has to cover the range of the node being freed */
+	xas_update(xas, child);
+	xas->xa_node = XAS_RESTART;
+}
+
 static void xas_delete_node(struct xa_state *xas)
 {
         struct xa_node *node = xas->xa_node;
@@ -374,6 +1128,30 @@ static void xas_delete_node(struct xa_state *xas)
 
 	if (!node->parent)
 		xas_shrink(xas);
+	else if (node->count == 1 && xa_compressed(xas->xa))
+		xas_collapse(xas, node);
+}
+
+/* The nodes whose subtree has no more indexes than @total holds */
+#define XA_TOTAL_SHIFT		(31 - XA_CHUNK_SHIFT)
+
+static inline bool node_totalled(const struct xa_node *node)
+{
+	return node->shift < XA_TOTAL_SHIFT;
+}
+
+/*
+ * Add @nr to the indexes of the subtrees of @node and its ancestors. The
+ * nodes which could cover more indexes than @total holds don't keep it.
+ */
+static void node_add_total(const struct xarray *xa, struct xa_node *node,
+			   long nr)
+{
+	if (!xa_counted(xa) || !nr)
+		return;
+
+	for (; node && node_totalled(node); node = xa_parent(xa, node))
+		node->total += nr;
 }
 
 static void update_node(struct xa_state *xas,
@@ -398,10 +1176,15 @@ static void *xas_alloc(struct xa_state *xas, unsigned int shift)
 	if (xas_invalid(xas))
 		return NULL;
 
+	if (xa_over_budget(xas->xa)) {
+		xas_set_err(xas, -ENOMEM);
+		return NULL;
+	}
+
 	if (node) {
 		xas->xa_alloc = NULL;
         } else {
-		node = malloc(sizeof(*node));
+		node = xa_node_alloc(xas->xa);
 		if (!node) {
 			xas_set_err(xas, -ENOMEM);
 			return NULL;
@@ -415,10 +1198,14 @@ static void *xas_alloc(struct xa_state *xas, unsigned int shift)
 	}
 
 	node->shift = shift;
+	node->index = node_base(xas->xa_index, shift);
 	node->count = 0;
 	node->nr_values = 0;
 	node->parent = xas->xa_node;
 	node->array = xas->xa;
+	node->gen = xas->xa->xa_gen;
+	xa_account_node(xas->xa, 1);
+	xa_stat_inc(xas->xa, XA_STAT_NODE_ALLOC);
 
 	return node;
 }
@@ -437,8 +1224,18 @@ static void xas_free_nodes(struct xa_state *xas, struct xa_node *top)
 			continue;
 		}
 
-		if (entry)
+		if (xa_is_packed(xas->xa, node, entry)) {
+			struct xa_packed *packed = entry;
+			int nr = __builtin_popcount(packed->present);
+
+			xa_account_entries(xas->xa, -nr);
+			xa_packed_free(xas->xa, packed);
+			node->slots[offset] = XA_RETRY_ENTRY;
+		} else if (entry) {
+			if (entry_accounted(entry))
+				xa_account_entries(xas->xa, -1);
 			node->slots[offset] = XA_RETRY_ENTRY;
+		}
 
 		offset++;
 		while (offset == XA_CHUNK_SIZE) {
@@ -456,11 +1253,54 @@ static void xas_free_nodes(struct xa_state *xas, struct xa_node *top)
 	}
 }
 
+/*
+ * The shift of the child is known, so the line of the slot to be visited
+ * in the child is fetched together with the header.
+ */
+static inline void xas_prefetch_child(const struct xa_state *xas,
+				      const struct xa_node *node, void *entry)
+{
+	struct xa_node *child;
+	unsigned int shift;
+
+	if (!xa_prefetch_distance || !node->shift || !xa_is_node(entry))
+		return;
+
+	child = xa_to_node(entry);
+	shift = node->shift - XA_CHUNK_SHIFT;
+	__builtin_prefetch(child);
+	__builtin_prefetch(&child->slots[(xas->xa_index >> shift) &
+					 XA_CHUNK_MASK]);
+}
+
+/* Prefetch the subtree ahead of the one which is going to be visited */
+static inline void xas_prefetch_ahead(const struct xa_state *xas)
+{
+	unsigned int offset = xas->xa_offset + xa_prefetch_distance;
+	void *entry;
+
+	if (!xa_prefetch_distance || offset >= XA_CHUNK_SIZE)
+		return;
+
+	entry = xa_entry(xas->xa, xas->xa_node, offset);
+	if (xa_is_node(entry))
+		__builtin_prefetch(xa_to_node(entry));
+}
+
+/*
+ * The position is left at the parent's slot when @node is a compressed
+ * node which doesn't cover the index.
+ */
 static void *xas_descend(struct xa_state *xas, struct xa_node *node)
 {
-	unsigned int offset = get_offset(node, xas->xa_index);
-	void *entry = xa_entry(xas->xa, node, offset);
+	unsigned int offset;
+	void *entry;
 
+	if (unlikely(!node_covers(node, xas->xa_index)))
+		return NULL;
+
+	offset = get_offset(node, xas->xa_index);
+	entry = xa_entry(xas->xa, node, offset);
 	xas->xa_node = node;
 	while (xa_is_sibling(entry)) {
 		offset = xa_to_sibling(entry);
@@ -470,6 +1310,7 @@ static void *xas_descend(struct xa_state *xas, struct xa_node *node)
 	}
 
 	xas->xa_offset = offset;
+	xas_prefetch_child(xas, node, entry);
 	return entry;
 }
 
@@ -491,6 +1332,21 @@ static inline void *xas_reload(struct xa_state *xas)
 	return xa_entry(xas->xa, node, offset);
 }
 
+/* The inline entries are moved to the tree for the advanced API */
+static inline bool xas_inline_promote(struct xa_state *xas)
+{
+	int ret;
+
+	if (likely(!xa_inlined(xas->xa)))
+		return true;
+
+	ret = xa_inline_promote(xas->xa);
+	if (ret)
+		xas_set_err(xas, ret);
+
+	return !ret;
+}
+
 static void *xas_start(struct xa_state *xas)
 {
 	void *entry;
@@ -498,7 +1354,7 @@ static void *xas_start(struct xa_state *xas)
 	if (xas_valid(xas))
 		return xas_reload(xas);
 
-	if (xas_error(xas))
+	if (xas_error(xas) || !xas_inline_promote(xas))
 		return NULL;
 
 	entry = xa_head(xas->xa);
@@ -514,16 +1370,28 @@ static void *xas_start(struct xa_state *xas)
 	return entry;
 }
 
-void *xas_load(struct xa_state *xas)
+/* Whether the node is within the range of the multi-index entry */
+static bool xas_within(const struct xa_state *xas, const struct xa_node *node)
+{
+	if (xas->xa_shift >= BITS_PER_LONG)
+		return true;
+
+	return ((node->index - xas->xa_index) >> xas->xa_shift) <= xas->xa_sibs;
+}
+
+static void *__xas_load(struct xa_state *xas, void *entry)
 {
 	struct xa_node *node;
-	void *entry = xas_start(xas);
 
 	while (xa_is_node(entry)) {
 		node = xa_to_node(entry);
 
-		if (xas->xa_shift > node->shift)
+		if (xas->xa_shift > node->shift) {
+			/* The compressed node might be beside the range */
+			if (!xas_within(xas, node))
+				entry = NULL;
 			break;
+		}
 		entry = xas_descend(xas, node);
 		if (node->shift == 0)
 			break;
@@ -532,20 +1400,107 @@ void *xas_load(struct xa_state *xas)
 	return entry;
 }
 
+void *xas_load(struct xa_state *xas)
+{
+	return __xas_load(xas, xas_start(xas));
+}
+
+/* Same as xas_load(), but starts from the hinted node if it's possible */
+static void *xas_load_hint(struct xa_state *xas)
+{
+	struct xa_hint *hint = &xa_hint;
+	struct xarray *xa = xas->xa;
+	unsigned int shift;
+	void *entry;
+
+	if (hint->xa == xa && hint->seq == xa->xa_seq && xas->xa_shift == 0) {
+		shift = hint->node->shift + XA_CHUNK_SHIFT;
+		if (shift >= BITS_PER_LONG ||
+		    !((xas->xa_index ^ hint->index) >> shift)) {
+			xa_stat_inc(xa, XA_STAT_HINT);
+			return __xas_load(xas, xa_mk_node(hint->node));
+		}
+	}
+
+	entry = __xas_load(xas, xas_start(xas));
+	if (!xas_top(xas->xa_node)) {
+		hint->xa = xa;
+		hint->node = xas->xa_node;
+		hint->seq = xa->xa_seq;
+		hint->index = xas->xa_index;
+	}
+
+	return entry;
+}
+
+/*
+ * Replace the node at the position, whose slots all have @entry with the
+ * same marks, by @entry in the parent's slot. The parent is coalesced in
+ * turn. The node skipping levels isn't coalesced.
+ */
+static void xas_coalesce(struct xa_state *xas, void *entry)
+{
+	struct xa_node *parent, *node = xas->xa_node;
+	unsigned int offset, marks;
+	long entries;
+	void *curr;
+
+	while (node->count == XA_CHUNK_SIZE) {
+		parent = xa_parent(xas->xa, node);
+		if (!parent || node->shift + XA_CHUNK_SHIFT != parent->shift)
+			break;
+
+		marks = node_get_marks(node, 0);
+		entries = 0;
+		for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+			curr = xa_entry(xas->xa, node, offset);
+			if (xa_is_sibling(curr))
+				continue;
+			if (curr != entry || node_get_marks(node, offset) != marks)
+				return;
+
+			entries++;
+		}
+
+		xas->xa_node = parent;
+		xas->xa_offset = node->offset;
+		parent->slots[node->offset] = entry;
+		parent->nr_values += xa_is_value(entry);
+		xa_account_entries(xas->xa, (1 - entries) * entry_accounted(entry));
+		xas_update(xas, parent);
+		xa_node_free(node);
+		node = parent;
+	}
+}
+
+/* The old head couldn't be coalesced when it had no parent */
+static void xas_coalesce_child(struct xa_state *xas, struct xa_node *child)
+{
+	void *entry = xa_entry(xas->xa, child, 0);
+
+	if (!entry || xa_is_internal(entry))
+		return;
+
+	xas->xa_node = child;
+	xas_coalesce(xas, entry);
+	xas->xa_node = NULL;
+}
+
 static int xas_expand(struct xa_state *xas, void *head)
 {
 	struct xarray *xa = xas->xa;
 	struct xa_node *node = NULL;
-	unsigned int shift = 0;
+	unsigned int shift = 0, top = 0;
 	unsigned long max = xas_max(xas);
 	xa_mark_t mark;
 
+	while ((max >> top) >= XA_CHUNK_SIZE)
+		top += XA_CHUNK_SHIFT;
+
 	if (!head) {
 		if (max == 0)
 			return 0;
-		while ((max >> shift) >= XA_CHUNK_SIZE)
-			shift += XA_CHUNK_SHIFT;
-		return shift + XA_CHUNK_SHIFT;
+		return top + XA_CHUNK_SHIFT;
         }
 
 	if (xa_is_node(head)) {
@@ -553,6 +1508,10 @@ static int xas_expand(struct xa_state *xas, void *head)
 		shift = node->shift + XA_CHUNK_SHIFT;
 	}
 
+	/* The old head is linked to the new head as a compressed node */
+	if (xa_compressed(xa) && xa_is_node(head) && shift < top)
+		shift = top;
+
 	xas->xa_node = NULL;
 	while (max > max_index(head)) {
                 mark = 0;
@@ -561,9 +1520,12 @@ static int xas_expand(struct xa_state *xas, void *head)
 		if (!node)
 			return -ENOMEM;
 
+		node->index = 0;
 		node->count = 1;
 		if (xa_is_value(head))
 			node->nr_values = 1;
+		node->total = xa_is_node(head) ? xa_to_node(head)->total :
+			      entry_accounted(head);
 		node->slots[0] = head;
 
 		/* Propagate the aggregated mark info to the new child */
@@ -596,14 +1558,172 @@ static int xas_expand(struct xa_state *xas, void *head)
 		head = xa_mk_node(node);
 		xa->xa_head = head;
 		xas_update(xas, node);
+		xa_stat_inc(xa, XA_STAT_EXPAND);
+		trace_event(TRACE_XAS_EXPAND, xas->xa_index, shift, (u64)node);
+
+		if (xa_coalesced(xa) && xa_is_node(node->slots[0]))
+			xas_coalesce_child(xas, xa_to_node(node->slots[0]));
 
 		shift += XA_CHUNK_SHIFT;
+		if (xa_compressed(xa) && shift < top)
+			shift = top;
 	}
 
 	xas->xa_node = node;
 	return shift;
 }
 
+/*
+ * The compressed node in the slot doesn't cover the index, or it's below
+ * the entry. A node is inserted above it, at the highest level where the
+ * index and the node diverge, or the level of the entry.
+ */
+static struct xa_node *xas_split_path(struct xa_state *xas,
+				      struct xa_node *child, void **slot)
+{
+	struct xa_node *node, *parent = xas->xa_node;
+	unsigned long diff = xas->xa_index ^ child->index;
+	unsigned int shift = xas->xa_shift, offset;
+	xa_mark_t mark = XA_MARK_0;
+
+	diff &= ~((XA_CHUNK_SIZE << child->shift) - 1);
+	if (diff && __fls(diff) / XA_CHUNK_SHIFT * XA_CHUNK_SHIFT > shift)
+		shift = __fls(diff) / XA_CHUNK_SHIFT * XA_CHUNK_SHIFT;
+
+	node = xas_alloc(xas, shift);
+	if (!node)
+		return NULL;
+
+	/* The slot is taken over rather than populated */
+	parent->count--;
+
+	offset = get_offset(node, child->index);
+	node->slots[offset] = xa_mk_node(child);
+	node->count = 1;
+	node->total = child->total;
+	for (;;) {
+		if (node_any_mark(child, mark))
+			node_set_mark(node, offset, mark);
+		if (mark == XA_MARK_MAX)
+			break;
+		mark_inc(mark);
+	}
+
+	child->parent = node;
+	child->offset = offset;
+	*slot = xa_mk_node(node);
+	return node;
+}
+
+/* The canonical slot at the position is followed by its siblings */
+static bool xas_has_siblings(const struct xa_state *xas)
+{
+	unsigned int offset = xas->xa_offset + 1;
+
+	return offset < XA_CHUNK_SIZE &&
+	       xa_entry(xas->xa, xas->xa_node, offset) ==
+	       xa_mk_sibling(xas->xa_offset);
+}
+
+/* The canonical slot of the entry at @offset */
+static unsigned int node_canon(const struct xarray *xa,
+			       const struct xa_node *node, unsigned int offset)
+{
+	void *entry = xa_entry(xa, node, offset);
+
+	return xa_is_sibling(entry) ? xa_to_sibling(entry) : offset;
+}
+
+/* An entry at the position covers indexes out of the store */
+static bool xas_multi(const struct xa_state *xas)
+{
+	struct xa_node *node = xas->xa_node;
+	unsigned int first, last;
+
+	if (xas_not_node(node))
+		return false;
+	if (node->shift > xas->xa_shift)
+		return xa_entry(xas->xa, node, xas->xa_offset) != NULL;
+
+	first = get_offset(node, xas->xa_index);
+	last = first + xas->xa_sibs;
+	if (node_canon(xas->xa, node, first) != first)
+		return true;
+
+	return last + 1 < XA_CHUNK_SIZE &&
+	       xa_is_sibling(xa_entry(xas->xa, node, last + 1));
+}
+
+/* Copy the entry at @canon to its sibling slots with its marks */
+static void xas_unsibling_one(struct xa_state *xas, unsigned int canon)
+{
+	struct xa_node *node = xas->xa_node;
+	unsigned int offset, marks = node_get_marks(node, canon);
+	void *entry = xa_entry(xas->xa, node, canon);
+
+	for (offset = canon + 1; offset < XA_CHUNK_SIZE; offset++) {
+		if (xa_entry(xas->xa, node, offset) != xa_mk_sibling(canon))
+			break;
+
+		node->slots[offset] = entry;
+		node_set_marks(node, offset, NULL, marks);
+		node->nr_values += xa_is_value(entry);
+		xa_account_entries(xas->xa, entry_accounted(entry));
+	}
+}
+
+/*
+ * Break up the multi-index entries which reach out of the slots of the
+ * store, and move to the slot of the index.
+ */
+static void xas_unsibling(struct xa_state *xas)
+{
+	struct xa_node *node = xas->xa_node;
+	unsigned int first = get_offset(node, xas->xa_index);
+	unsigned int last = first + xas->xa_sibs;
+
+	xas_unsibling_one(xas, node_canon(xas->xa, node, first));
+	if (last + 1 < XA_CHUNK_SIZE)
+		xas_unsibling_one(xas, node_canon(xas->xa, node, last + 1));
+
+	xas->xa_offset = first;
+	xas_update(xas, node);
+}
+
+/* Replace the multi-index entry at the position by a node full of it */
+static struct xa_node *xas_split_entry(struct xa_state *xas,
+				       unsigned int shift, void *entry)
+{
+	struct xa_node *node, *parent = xas->xa_node;
+	unsigned int i, marks;
+
+	if (xas_has_siblings(xas)) {
+		xas_unsibling_one(xas, xas->xa_offset);
+		xas->xa_offset = get_offset(parent, xas->xa_index);
+		xas_update(xas, parent);
+	}
+
+	marks = node_get_marks(parent, xas->xa_offset);
+	node = xas_alloc(xas, shift);
+	if (!node)
+		return NULL;
+
+	/* The slot has been occupied */
+	parent->count--;
+	parent->nr_values -= xa_is_value(entry);
+
+	for (i = 0; i < XA_CHUNK_SIZE; i++)
+		node->slots[i] = entry;
+	node->count = XA_CHUNK_SIZE;
+	node->nr_values = xa_is_value(entry) ? XA_CHUNK_SIZE : 0;
+	node_set_marks(parent, xas->xa_offset, node, marks);
+	parent->slots[xas->xa_offset] = xa_mk_node(node);
+	xa_account_entries(xas->xa,
+			   (XA_CHUNK_SIZE - 1) * entry_accounted(entry));
+
+	return node;
+}
+
 static void *xas_create(struct xa_state *xas, bool allow_root)
 {
 	struct xarray *xa = xas->xa;
@@ -613,6 +1733,9 @@ static void *xas_create(struct xa_state *xas, bool allow_root)
 	int shift;
 
 	if (xas_top(node)) {
+		if (!xas_inline_promote(xas))
+			return NULL;
+
 		entry = xa_head(xa);
 		xas->xa_node = NULL;
 		if (!entry && xa_zero_busy(xa))
@@ -641,6 +1764,10 @@ static void *xas_create(struct xa_state *xas, bool allow_root)
 	while (shift > order) {
 		shift -= XA_CHUNK_SHIFT;
 		if (!entry) {
+			/* Skip the levels down to the entry below the head */
+			if (xa_compressed(xa) && xas->xa_node)
+				shift = order;
+
 			node = xas_alloc(xas, shift);
 			if (!node)
 				break;
@@ -650,6 +1777,18 @@ static void *xas_create(struct xa_state *xas, bool allow_root)
 			*slot = xa_mk_node(node);
 		} else if (xa_is_node(entry)) {
 			node = xa_to_node(entry);
+			if (node->shift < order ||
+			    !node_covers(node, xas->xa_index)) {
+				node = xas_split_path(xas, node, slot);
+				if (!node)
+					break;
+			}
+
+			shift = node->shift;
+		} else if (xa_coalesced(xa) && !xa_is_internal(entry)) {
+			node = xas_split_entry(xas, shift, entry);
+			if (!node)
+				break;
 		} else {
 			break;
 		}
@@ -658,6 +1797,12 @@ static void *xas_create(struct xa_state *xas, bool allow_root)
 		slot = &node->slots[xas->xa_offset];
 	}
 
+	if (xa_coalesced(xa) && !xas_invalid(xas) && xas_multi(xas) &&
+	    xas->xa_node->shift == order) {
+		xas_unsibling(xas);
+		entry = xa_entry(xa, xas->xa_node, xas->xa_offset);
+	}
+
 	return entry;
 }
 
@@ -668,15 +1813,30 @@ void *xas_store(struct xa_state *xas, void *entry)
 	unsigned int offset, max;
 	int count = 0;
 	int values = 0;
-	void *first, *next;
+	long entries = entry_accounted(entry), freed = 0, slots = 0;
+	void *first, *next, *stored = entry;
 	bool value = xa_is_value(entry);
 	bool allow_root;
 
+	trace_event(TRACE_XAS_STORE, xas->xa_index, xas->xa_shift,
+		    xas->xa_sibs, (u64)entry);
+
 	if (entry) {
+		/* The same entry mustn't split the coalesced one */
+		if (xa_coalesced(xas->xa) && !xas->xa_sibs) {
+			first = xas_load(xas);
+			if (first == entry)
+				return first;
+			if (!xas_error(xas))
+				xas_reset(xas);
+		}
+
 		allow_root = !xa_is_node(entry) && !xa_is_zero(entry);
 		first = xas_create(xas, allow_root);
 	} else {
 		first = xas_load(xas);
+		if (xa_coalesced(xas->xa) && xas_multi(xas))
+			first = xas_create(xas, true);
 	}
 
 	if (xas_invalid(xas))
@@ -707,9 +1867,15 @@ void *xas_store(struct xa_state *xas, void *entry)
 		 * so the mark clearing will appear to happen before the
 		 * entry is set to NULL.
 		 */
+		if (entry_accounted(next))
+			entries--;
+		slots += (entry && entry_accounted(stored)) -
+			 entry_accounted(first);
 		*slot = entry;
-		if (xa_is_node(next) && (!node || node->shift))
+		if (xa_is_node(next) && (!node || node->shift)) {
+			freed += xa_to_node(next)->total;
 			xas_free_nodes(xas, xa_to_node(next));
+		}
 		if (!node)
 			break;
 
@@ -733,7 +1899,15 @@ void *xas_store(struct xa_state *xas, void *entry)
 		slot++;
 	}
 
+	xa_account_entries(xas->xa, entries);
+	if (node && node_totalled(node))
+		node_add_total(xas->xa, node,
+			       slots * (1L << node->shift) - freed);
+	xas_dirty(xas, node);
 	update_node(xas, node, count, values);
+	if (xa_coalesced(xas->xa) && stored && !xa_is_internal(stored) &&
+	    node && xas->xa_node == node)
+		xas_coalesce(xas, stored);
 	return first;
 }
 
@@ -787,11 +1961,13 @@ void xas_split(struct xa_state *xas, void *entry, unsigned int order)
 	struct xa_node *node, *child;
 	void *curr = xas_load(xas);
 	int values = 0;
+	long entries = -entry_accounted(curr), slots = 0;
 
 	node = xas->xa_node;
 	if (xas_top(node))
 		return;
 
+	trace_event(TRACE_XAS_SPLIT, xas->xa_index, order, (u64)entry);
 	marks = node_get_marks(node, xas->xa_offset);
 	offset = xas->xa_offset + sibs;
 	do {
@@ -799,15 +1975,23 @@ void xas_split(struct xa_state *xas, void *entry, unsigned int order)
 			child = xas->xa_alloc;
                         xas->xa_alloc = child->parent;
 			child->shift = node->shift - XA_CHUNK_SHIFT;
+			child->index = node->index +
+				       ((unsigned long)offset << node->shift);
 			child->offset = offset;
 			child->count = XA_CHUNK_SIZE;
 			child->nr_values = xa_is_value(entry) ?
 					   XA_CHUNK_SIZE : 0;
+			child->total = entry_accounted(entry) *
+				       (XA_CHUNK_SIZE << child->shift);
 			child->parent = node;
 			node_set_marks(node, offset, child, marks);
 			node->slots[offset] = xa_mk_node(child);
 			if (xa_is_value(curr))
 				values--;
+			if (entry_accounted(entry))
+				entries += XA_CHUNK_SIZE / (xas->xa_sibs + 1);
+			xa_account_node(xas->xa, 1);
+			xa_stat_inc(xas->xa, XA_STAT_NODE_ALLOC);
 			xas_update(xas, child);
 		} else {
 			canon = offset - xas->xa_sibs;
@@ -817,9 +2001,15 @@ void xas_split(struct xa_state *xas, void *entry, unsigned int order)
 				node->slots[offset--] = xa_mk_sibling(canon);
 			values += (xa_is_value(entry) - xa_is_value(curr)) *
 				  (xas->xa_sibs + 1);
+			entries += entry_accounted(entry);
 		}
+		slots++;
 	} while (offset-- > xas->xa_offset);
 
+	xa_account_entries(xas->xa, entries);
+	if (node_totalled(node))
+		node_add_total(xas->xa, node, slots * (1L << node->shift) *
+			       (entry_accounted(entry) - entry_accounted(curr)));
 	node->nr_values += values;
 	xas_update(xas, node);
 }
@@ -844,7 +2034,10 @@ void xas_split_alloc(struct xa_state *xas, void *entry, unsigned int order)
 		void *sibling = NULL;
 		struct xa_node *node;
 
-		node = malloc(sizeof(*node));
+		if (xa_over_budget(xas->xa))
+			goto nomem;
+
+		node = xa_node_alloc(xas->xa);
 		if (!node)
 			goto nomem;
 
@@ -900,8 +2093,27 @@ static void xas_set_range(struct xa_state *xas,
 	xas->xa_sibs = sibs;
 }
 
+/*
+ * Step into the child node in the iteration. The compressed node is
+ * skipped if it's behind the index, otherwise the index is advanced to
+ * the start of it.
+ */
+static bool xas_enter(struct xa_state *xas, struct xa_node *node)
+{
+	if (xas->xa_index > node->index + (XA_CHUNK_SIZE << node->shift) - 1)
+		return false;
+
+	if (xas->xa_index < node->index)
+		xas->xa_index = node->index;
+
+	xas->xa_node = node;
+	xas_set_offset(xas);
+	return true;
+}
+
 void *xas_find(struct xa_state *xas, unsigned long max)
 {
+	bool advance = true;
 	void *entry;
 
 	if (xas_error(xas) || xas->xa_node == XAS_BOUNDS)
@@ -918,24 +2130,35 @@ void *xas_find(struct xa_state *xas, unsigned long max)
 		entry = xas_load(xas);
 		if (entry || xas_not_node(xas->xa_node))
 			return entry;
+
+		/* Stopped by a compressed node, which might be ahead */
+		entry = xa_entry(xas->xa, xas->xa_node, xas->xa_offset);
+		advance = !xa_is_node(entry);
         }
 
-	if (!xas->xa_node->shift &&
-	    xas->xa_offset != (xas->xa_index & XA_CHUNK_MASK))
-                xas->xa_offset = ((xas->xa_index - 1) & XA_CHUNK_MASK) + 1;
+	if (advance) {
+		if (!xas->xa_node->shift &&
+		    xas->xa_offset != (xas->xa_index & XA_CHUNK_MASK))
+			xas->xa_offset = ((xas->xa_index - 1) &
+					  XA_CHUNK_MASK) + 1;
+
+		xas_next_offset(xas);
+	}
 
-	xas_next_offset(xas);
 	while (xas->xa_node && (xas->xa_index <= max)) {
 		if (xas->xa_offset == XA_CHUNK_SIZE) {
 			xas->xa_offset = xas->xa_node->offset + 1;
 			xas->xa_node = xa_parent(xas->xa, xas->xa_node);
+			if (xas->xa_node)
+				xas_slot_index(xas);
 			continue;
 		}
 
 		entry = xa_entry(xas->xa, xas->xa_node, xas->xa_offset);
 		if (xa_is_node(entry)) {
-			xas->xa_node = xa_to_node(entry);
-			xas->xa_offset = 0;
+			xas_prefetch_ahead(xas);
+			if (!xas_enter(xas, xa_to_node(entry)))
+				xas_next_offset(xas);
 			continue;
 		}
 
@@ -1117,6 +2340,7 @@ void *xas_find_marked(struct xa_state *xas, unsigned long max, xa_mark_t mark)
 			xas->xa_node = xa_parent(xas->xa, xas->xa_node);
 			if (!xas->xa_node)
 				break;
+			xas_slot_index(xas);
 			advance = false;
 			continue;
 		}
@@ -1149,8 +2373,7 @@ void *xas_find_marked(struct xa_state *xas, unsigned long max, xa_mark_t mark)
 		if (!xa_is_node(entry))
 			return entry;
 
-		xas->xa_node = xa_to_node(entry);
-		xas_set_offset(xas);
+		advance = !xas_enter(xas, xa_to_node(entry));
 	}
 
 out:
@@ -1162,241 +2385,3077 @@ max:
 	return NULL;
 }
 
-/******************* XArray public APIs */
-
-void xa_init(struct xarray *xa)
+/* Like xas_find(), for the entries whose marks match @expr */
+void *xas_find_marks(struct xa_state *xas, unsigned long max, xa_marks_t expr)
+{
+	bool advance = true;
+	unsigned int offset, marks, i;
+	void *entry;
+
+	if (xas_error(xas))
+		return NULL;
+
+	if (xas->xa_index > max)
+		goto max;
+
+	if (!xas->xa_node) {
+		xas->xa_index = 1;
+		goto out;
+	}
+
+	if (xas_top(xas->xa_node)) {
+		advance = false;
+		entry = xa_head(xas->xa);
+		xas->xa_node = NULL;
+		if (xas->xa_index > max_index(entry))
+			goto out;
+
+		if (!xa_is_node(entry)) {
+			marks = 0;
+			for (i = 0; i < XA_MAX_MARKS; i++) {
+				if (xa_marked(xas->xa, (__force xa_mark_t)i))
+					marks |= 1U << i;
+			}
+			if (entry && (expr & (1U << marks)))
+				return entry;
+			xas->xa_index = 1;
+			goto out;
+		}
+
+		xas->xa_node = xa_to_node(entry);
+		xas->xa_offset = xas->xa_index >> xas->xa_node->shift;
+	}
+
+	while (xas->xa_index <= max) {
+		if (xas->xa_offset == XA_CHUNK_SIZE) {
+			xas->xa_offset = xas->xa_node->offset + 1;
+			xas->xa_node = xa_parent(xas->xa, xas->xa_node);
+			if (!xas->xa_node)
+				break;
+			xas_slot_index(xas);
+			advance = false;
+			continue;
+		}
+
+		/* The index is kept in the entry, like xas_find() does */
+		if (!advance) {
+			entry = xa_entry(xas->xa, xas->xa_node, xas->xa_offset);
+			if (xa_is_sibling(entry))
+				xas->xa_offset = xa_to_sibling(entry);
+		}
+
+		offset = xas_find_chunk_marks(xas, advance, expr);
+		if (offset > xas->xa_offset) {
+			advance = false;
+			xas_move_index(xas, offset);
+			/* Mind the wrap */
+			if ((xas->xa_index - 1) >= max)
+				goto max;
+
+			xas->xa_offset = offset;
+			if (offset == XA_CHUNK_SIZE)
+				continue;
+		}
+
+		/* The unmarked slots match when the expression allows them */
+		entry = xa_entry(xas->xa, xas->xa_node, xas->xa_offset);
+		if (!entry || xa_is_sibling(entry)) {
+			advance = true;
+			continue;
+		}
+
+		if (!xa_is_node(entry)) {
+			marks = node_get_marks(xas->xa_node, xas->xa_offset);
+			if (expr & (1U << marks))
+				return entry;
+			advance = true;
+			continue;
+		}
+
+		advance = !xas_enter(xas, xa_to_node(entry));
+	}
+
+out:
+	if (xas->xa_index > max)
+		goto max;
+	return set_bounds(xas);
+max:
+	xas->xa_node = XAS_RESTART;
+	return NULL;
+}
+
+/******************* XArray inline entries */
+
+/*
+ * The allocating arrays need the free mark, which is kept by the tree. The
+ * adaptive arrays keep their entries in their own nodes.
+ */
+static void xa_inline_init(struct xarray *xa)
+{
+	if ((xa->xa_flags & XA_FLAGS_INLINE) && !xa_track_free(xa) &&
+	    !xa_adaptive(xa))
+		xa->xa_nr_inline = 0;
+	else
+		xa->xa_nr_inline = XA_INLINE_TREE;
+}
+
+/* The first inline slot whose index isn't below @index */
+static unsigned int xa_inline_slot(const struct xarray *xa,
+				   unsigned long index)
+{
+	unsigned int i;
+
+	for (i = 0; i < xa->xa_nr_inline; i++) {
+		if (xa->xa_inline[i].index >= index)
+			break;
+	}
+
+	return i;
+}
+
+static void *xa_inline_load(const struct xarray *xa, unsigned long index)
+{
+	unsigned int i = xa_inline_slot(xa, index);
+
+	if (i < xa->xa_nr_inline && xa->xa_inline[i].index == index)
+		return xa->xa_inline[i].entry;
+
+	return NULL;
+}
+
+static void *xa_inline_find(const struct xarray *xa, unsigned long *indexp,
+			    unsigned long max)
+{
+	unsigned int i = xa_inline_slot(xa, *indexp);
+
+	if (i == xa->xa_nr_inline || xa->xa_inline[i].index > max)
+		return NULL;
+
+	*indexp = xa->xa_inline[i].index;
+	return xa->xa_inline[i].entry;
+}
+
+/*
+ * Store @entry to the inline slots, or erase the entry when @entry is
+ * NULL. It returns false when the slots are full, and the entries have
+ * to be moved to the tree.
+ */
+static bool xa_inline_store(struct xarray *xa, unsigned long index,
+			    void *entry, void **currp)
+{
+	unsigned int i = xa_inline_slot(xa, index);
+	unsigned int nr = xa->xa_nr_inline;
+	struct xa_inline *slot = &xa->xa_inline[i];
+	void *curr = NULL;
+
+	if (i < nr && slot->index == index)
+		curr = slot->entry;
+
+	if (curr && entry) {
+		slot->entry = entry;
+	} else if (curr) {
+		memmove(slot, slot + 1, (nr - i - 1) * sizeof(*slot));
+		xa->xa_nr_inline--;
+	} else if (entry) {
+		if (nr == XA_INLINE_SLOTS)
+			return false;
+
+		memmove(slot + 1, slot, (nr - i) * sizeof(*slot));
+		slot->index = index;
+		slot->entry = entry;
+		xa->xa_nr_inline++;
+	}
+
+	xa_account_entries(xa, entry_accounted(entry) - entry_accounted(curr));
+	*currp = curr;
+	return true;
+}
+
+/*
+ * Move the inline entries to the tree. The slots are left untouched, so
+ * that the inline entries can be restored if the tree can't be built.
+ */
+static int xa_inline_promote(struct xarray *xa)
+{
+	struct xa_inline *slots = xa->xa_inline;
+	unsigned int i, nr = xa->xa_nr_inline;
+	int ret = 0;
+
+	xa->xa_nr_inline = XA_INLINE_TREE;
+	for (i = 0; i < nr; i++) {
+		XA_STATE(xas, xa, slots[i].index);
+
+		do {
+			xas_store(&xas, slots[i].entry);
+		} while (xas_nomem(&xas));
+
+		ret = xas_error(&xas);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		while (i--) {
+			XA_STATE(xas, xa, slots[i].index);
+
+			xas_store(&xas, NULL);
+		}
+
+		xa->xa_nr_inline = nr;
+		return ret;
+	}
+
+	/* The entries have been accounted when they're stored inline */
+	for (i = 0; i < nr; i++)
+		xa_account_entries(xa, -entry_accounted(slots[i].entry));
+
+	return 0;
+}
+
+/******************* XArray packed leaves */
+
+static void *xa_packed_get(const struct xa_packed *packed, unsigned int offset)
+{
+	unsigned int bit = offset * packed->width;
+
+	if (!(packed->present & (1U << offset)))
+		return NULL;
+
+	return xa_mk_value((packed->bits[bit / 8] >> (bit % 8)) &
+			   ((1U << packed->width) - 1));
+}
+
+/* The first entry from @indexp to @max in the packed leaf */
+static void *xa_packed_next(const struct xa_packed *packed,
+			    unsigned long *indexp, unsigned long max)
+{
+	unsigned long base = *indexp & ~XA_CHUNK_MASK;
+	unsigned int offset = *indexp & XA_CHUNK_MASK;
+	unsigned int present = packed->present >> offset << offset;
+
+	if (!present || base + __builtin_ctz(present) > max)
+		return NULL;
+
+	offset = __builtin_ctz(present);
+	*indexp = base + offset;
+	return xa_packed_get(packed, offset);
+}
+
+/* The first entry from @indexp to @max in the subtree of the node */
+static void *node_packed_find(const struct xarray *xa, struct xa_node *node,
+			      unsigned long *indexp, unsigned long max)
+{
+	unsigned long index = *indexp, start;
+	unsigned int offset;
+	void *entry;
+
+	if (index < node->index)
+		index = node->index;
+	if (!node_covers(node, index))
+		return NULL;
+
+	for (offset = get_offset(node, index); offset < XA_CHUNK_SIZE;
+	     offset++) {
+		start = node->index + ((unsigned long)offset << node->shift);
+		if (start > max)
+			break;
+		if (start < index)
+			start = index;
+
+		entry = xa_entry(xa, node, offset);
+		if (node->shift && xa_is_node(entry))
+			entry = node_packed_find(xa, xa_to_node(entry), &start,
+						 max);
+		else if (xa_is_packed(xa, node, entry))
+			entry = xa_packed_next(entry, &start, max);
+		else if (xa_is_internal(entry))
+			entry = NULL;
+
+		if (entry) {
+			*indexp = start;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* The packed leaves are searched in place, and the head covers index 0 */
+static void *xa_packed_find(const struct xarray *xa, unsigned long *indexp,
+			    unsigned long max)
+{
+	void *head = xa_head(xa);
+
+	if (xa_is_node(head))
+		return node_packed_find(xa, xa_to_node(head), indexp, max);
+	if (*indexp || xa_is_internal(head))
+		return NULL;
+
+	return head;
+}
+
+/*
+ * Replace the leaf at the position by a packed leaf in the parent's slot
+ * if its entries are all small values. The packed leaf takes less memory
+ * than the node, so the budget isn't checked.
+ */
+static void xas_pack(struct xa_state *xas)
+{
+	struct xa_node *parent, *node = xas->xa_node;
+	struct xa_packed *packed;
+	unsigned long max = 0;
+	unsigned int offset, width, bit;
+	void *entry;
+
+	if (!xas_is_node(xas) || node->shift || !node->count ||
+	    node->nr_values != node->count)
+		return;
+
+	parent = xa_parent(xas->xa, node);
+	if (!parent)
+		return;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		entry = xa_entry(xas->xa, node, offset);
+		if (entry && xa_to_value(entry) > XA_PACKED_MAX)
+			return;
+		if (entry)
+			max |= xa_to_value(entry);
+	}
+
+	for (width = 0; max >> width; width = width ? 2 * width : 1)
+		;
+
+	packed = calloc(1, xa_packed_size(width));
+	if (!packed)
+		return;
+
+	packed->width = width;
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		entry = xa_entry(xas->xa, node, offset);
+		if (!entry)
+			continue;
+
+		bit = offset * width;
+		packed->present |= 1U << offset;
+		if (width)
+			packed->bits[bit / 8] |= xa_to_value(entry) <<
+						 (bit % 8);
+	}
+
+	__xa_account_node(xas->xa, 1, xa_packed_size(width));
+	xa_stat_inc(xas->xa, XA_STAT_NODE_ALLOC);
+
+	xas->xa_node = parent;
+	xas->xa_offset = node->offset;
+	parent->slots[node->offset] = packed;
+	xas_update(xas, parent);
+
+	node->count = 0;
+	node->nr_values = 0;
+	xa_node_free(node);
+}
+
+/*
+ * Store a value which fits in the width of the packed leaf covering the
+ * index, or erase one of its values, in place. The old entry is returned
+ * through @currp.
+ */
+static bool xas_packed_update(struct xa_state *xas, void *entry,
+			      void **currp)
+{
+	struct xa_packed *packed = xas_load(xas);
+	unsigned int offset = xas->xa_index & XA_CHUNK_MASK;
+	unsigned int bit, mask;
+
+	if (!xas_is_node(xas) || !xa_is_packed(xas->xa, xas->xa_node, packed))
+		return false;
+
+	/* The last value is erased with the leaf */
+	mask = (1U << packed->width) - 1;
+	if (entry ? !xa_is_value(entry) || xa_to_value(entry) > mask :
+		    packed->present == 1U << offset)
+		return false;
+
+	*currp = xa_packed_get(packed, offset);
+	bit = offset * packed->width;
+	if (packed->width)
+		packed->bits[bit / 8] &= ~(mask << (bit % 8));
+	if (entry) {
+		packed->present |= 1U << offset;
+		if (packed->width)
+			packed->bits[bit / 8] |= xa_to_value(entry) <<
+						 (bit % 8);
+	} else {
+		packed->present &= ~(1U << offset);
+	}
+
+	xa_account_entries(xas->xa, !!entry - !!*currp);
+	return true;
+}
+
+/*
+ * Expand the packed leaf covering the index back into a node, which is
+ * stored to afterwards. The position is restarted.
+ */
+static void xas_unpack(struct xa_state *xas)
+{
+	struct xa_packed *packed = xas_load(xas);
+	struct xa_node *parent = xas->xa_node, *node;
+	unsigned int offset;
+	void *entry;
+
+	if (!xas_is_node(xas) || !xa_is_packed(xas->xa, parent, packed))
+		return;
+
+	node = xas_alloc(xas, 0);
+	if (!node)
+		return;
+
+	/* The slot has been counted by the parent */
+	parent->count--;
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		entry = xa_packed_get(packed, offset);
+		if (!entry)
+			continue;
+
+		node->slots[offset] = entry;
+		node->count++;
+		node->nr_values++;
+	}
+
+	parent->slots[xas->xa_offset] = xa_mk_node(node);
+	xa_packed_free(xas->xa, packed);
+	xas_reset(xas);
+}
+
+/******************* XArray adaptive nodes */
+
+/*
+ * Every node dispatches on one byte of the index. The nodes of 4 and 16
+ * slots keep the keys sorted, the node of 48 slots maps every key to its
+ * slot, and the node of 256 slots is indexed by the key. The slots of the
+ * nodes whose shift is zero are the entries, otherwise they're the child
+ * nodes, which can be more than one level below.
+ */
+#define XA_ART_SHIFT		8
+#define XA_ART_KEYS		(1UL << XA_ART_SHIFT)
+#define XA_ART_LEVELS		(BITS_PER_LONG / XA_ART_SHIFT)
+
+enum xa_art_type {
+	XA_ART_4,
+	XA_ART_16,
+	XA_ART_48,
+	XA_ART_256,
+	XA_ART_NR,
+};
+
+struct xa_art_node {
+	unsigned char	type;		/* enum xa_art_type */
+	unsigned char	shift;		/* Bits below the key */
+	unsigned short	count;		/* Occupied slots */
+	unsigned long	index;		/* First index covered */
+};
+
+struct xa_art_node4 {
+	struct xa_art_node	node;
+	u8			keys[4];
+	void			*slots[4];
+};
+
+struct xa_art_node16 {
+	struct xa_art_node	node;
+	u8			keys[16];
+	void			*slots[16];
+};
+
+/* The slot of a key is index[key] - 1, and zero means the key is absent */
+struct xa_art_node48 {
+	struct xa_art_node	node;
+	u8			index[XA_ART_KEYS];
+	void			*slots[48];
+};
+
+struct xa_art_node256 {
+	struct xa_art_node	node;
+	void			*slots[XA_ART_KEYS];
+};
+
+#define XA_ART_NODE(node, nr)	container_of(node, struct xa_art_node##nr, node)
+
+/*
+ * The node is moved to the smaller type when its count drops to @shrink,
+ * which is below the capacity of the smaller type. Otherwise, the node
+ * would be resized back and forth by the erase and store on the boundary.
+ */
+static const struct xa_art_class {
+	size_t		size;
+	unsigned int	capacity;
+	unsigned int	shrink;
+} xa_art_classes[XA_ART_NR] = {
+	[XA_ART_4]	= { sizeof(struct xa_art_node4),   4,   0  },
+	[XA_ART_16]	= { sizeof(struct xa_art_node16),  16,  3  },
+	[XA_ART_48]	= { sizeof(struct xa_art_node48),  48,  12 },
+	[XA_ART_256]	= { sizeof(struct xa_art_node256), 256, 36 },
+};
+
+static inline unsigned int xa_art_key(const struct xa_art_node *node,
+				      unsigned long index)
+{
+	return (index >> node->shift) & (XA_ART_KEYS - 1);
+}
+
+static inline bool xa_art_covers(const struct xa_art_node *node,
+				 unsigned long index)
+{
+	return ((index - node->index) >> node->shift) < XA_ART_KEYS;
+}
+
+static struct xa_art_node *xa_art_alloc(struct xarray *xa,
+					enum xa_art_type type,
+					unsigned int shift, unsigned long index)
+{
+	size_t size = xa_art_classes[type].size;
+	struct xa_art_node *node;
+
+	if (__xa_over_budget(xa, size))
+		return NULL;
+
+	node = calloc(1, size);
+	if (!node)
+		return NULL;
+
+	node->type = type;
+	node->shift = shift;
+	node->index = index & ~((XA_ART_KEYS << shift) - 1);
+	__xa_account_node(xa, 1, size);
+	xa_stat_inc(xa, XA_STAT_NODE_ALLOC);
+
+	return node;
+}
+
+static void xa_art_free(struct xarray *xa, struct xa_art_node *node)
+{
+	xa_stat_inc(xa, XA_STAT_NODE_FREE);
+	__xa_account_node(xa, -1, xa_art_classes[node->type].size);
+	free(node);
+}
+
+/* The keys and slots of the sorted nodes */
+static inline u8 *xa_art_keys(struct xa_art_node *node)
+{
+	if (node->type == XA_ART_4)
+		return XA_ART_NODE(node, 4)->keys;
+
+	return XA_ART_NODE(node, 16)->keys;
+}
+
+static inline void **xa_art_slots(struct xa_art_node *node)
+{
+	if (node->type == XA_ART_4)
+		return XA_ART_NODE(node, 4)->slots;
+
+	return XA_ART_NODE(node, 16)->slots;
+}
+
+/* All keys of the node of 16 slots are compared at once */
+static inline int xa_art_search16(struct xa_art_node16 *n, unsigned int key)
+{
+	unsigned int count = n->node.count;
+#if defined(__aarch64__)
+	uint8x16_t cmp = vceqq_u8(vdupq_n_u8(key), vld1q_u8(n->keys));
+	u64 mask;
+
+	/* Four bits for every key */
+	mask = vget_lane_u64(vreinterpret_u64_u8(
+		vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+	if (count < 16)
+		mask &= (1UL << (count * 4)) - 1;
+
+	return mask ? __ffs(mask) / 4 : -1;
+#elif defined(__x86_64__)
+	__m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(key),
+				     _mm_loadu_si128((__m128i *)n->keys));
+	unsigned long mask = _mm_movemask_epi8(cmp) & ((1UL << count) - 1);
+
+	return mask ? __ffs(mask) : -1;
+#else
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (n->keys[i] == key)
+			return i;
+	}
+
+	return -1;
+#endif
+}
+
+/* The slot of @key, or NULL if the key is absent */
+static void **xa_art_slot(struct xa_art_node *node, unsigned int key)
+{
+	struct xa_art_node4 *n4;
+	struct xa_art_node48 *n48;
+	struct xa_art_node256 *n256;
+	unsigned int i;
+	int found;
+
+	switch (node->type) {
+	case XA_ART_4:
+		n4 = XA_ART_NODE(node, 4);
+		for (i = 0; i < node->count; i++) {
+			if (n4->keys[i] == key)
+				return &n4->slots[i];
+		}
+
+		return NULL;
+	case XA_ART_16:
+		found = xa_art_search16(XA_ART_NODE(node, 16), key);
+		return found < 0 ? NULL : &XA_ART_NODE(node, 16)->slots[found];
+	case XA_ART_48:
+		n48 = XA_ART_NODE(node, 48);
+		i = n48->index[key];
+		return i ? &n48->slots[i - 1] : NULL;
+	default:
+		n256 = XA_ART_NODE(node, 256);
+		return n256->slots[key] ? &n256->slots[key] : NULL;
+	}
+}
+
+/* The slot of the first key which isn't below *@keyp, which is updated */
+static void **xa_art_next(struct xa_art_node *node, unsigned int *keyp)
+{
+	struct xa_art_node48 *n48;
+	struct xa_art_node256 *n256;
+	unsigned int i, key = *keyp;
+	u8 *keys;
+
+	switch (node->type) {
+	case XA_ART_4:
+	case XA_ART_16:
+		keys = xa_art_keys(node);
+		for (i = 0; i < node->count; i++) {
+			if (keys[i] >= key) {
+				*keyp = keys[i];
+				return &xa_art_slots(node)[i];
+			}
+		}
+
+		return NULL;
+	case XA_ART_48:
+		n48 = XA_ART_NODE(node, 48);
+		for (; key < XA_ART_KEYS; key++) {
+			if (n48->index[key]) {
+				*keyp = key;
+				return &n48->slots[n48->index[key] - 1];
+			}
+		}
+
+		return NULL;
+	default:
+		n256 = XA_ART_NODE(node, 256);
+		for (; key < XA_ART_KEYS; key++) {
+			if (n256->slots[key]) {
+				*keyp = key;
+				return &n256->slots[key];
+			}
+		}
+
+		return NULL;
+	}
+}
+
+/* Add the absent @key to the node, which isn't full */
+static void xa_art_add(struct xa_art_node *node, unsigned int key,
+		       void *child)
+{
+	struct xa_art_node48 *n48;
+	unsigned int i, nr = node->count;
+	void **slots;
+	u8 *keys;
+
+	switch (node->type) {
+	case XA_ART_4:
+	case XA_ART_16:
+		keys = xa_art_keys(node);
+		slots = xa_art_slots(node);
+		for (i = 0; i < nr && keys[i] < key; i++)
+			;
+
+		memmove(&keys[i + 1], &keys[i], nr - i);
+		memmove(&slots[i + 1], &slots[i], (nr - i) * sizeof(*slots));
+		keys[i] = key;
+		slots[i] = child;
+		break;
+	case XA_ART_48:
+		n48 = XA_ART_NODE(node, 48);
+		for (i = 0; n48->slots[i]; i++)
+			;
+
+		n48->slots[i] = child;
+		n48->index[key] = i + 1;
+		break;
+	default:
+		XA_ART_NODE(node, 256)->slots[key] = child;
+	}
+
+	node->count++;
+}
+
+/* Remove the present @key from the node */
+static void xa_art_remove(struct xa_art_node *node, unsigned int key)
+{
+	struct xa_art_node48 *n48;
+	unsigned int i, nr = node->count;
+	void **slots;
+	u8 *keys;
+
+	switch (node->type) {
+	case XA_ART_4:
+	case XA_ART_16:
+		keys = xa_art_keys(node);
+		slots = xa_art_slots(node);
+		for (i = 0; keys[i] != key; i++)
+			;
+
+		memmove(&keys[i], &keys[i + 1], nr - i - 1);
+		memmove(&slots[i], &slots[i + 1], (nr - i - 1) * sizeof(*slots));
+		break;
+	case XA_ART_48:
+		n48 = XA_ART_NODE(node, 48);
+		n48->slots[n48->index[key] - 1] = NULL;
+		n48->index[key] = 0;
+		break;
+	default:
+		XA_ART_NODE(node, 256)->slots[key] = NULL;
+	}
+
+	node->count--;
+}
+
+/* Replace the node referred by @ref with a copy of the given type */
+static struct xa_art_node *xa_art_resize(struct xarray *xa, void **ref,
+					 enum xa_art_type type)
+{
+	struct xa_art_node *new, *node = *ref;
+	unsigned int key;
+	void **slot;
+
+	new = xa_art_alloc(xa, type, node->shift, node->index);
+	if (!new)
+		return NULL;
+
+	for (key = 0; (slot = xa_art_next(node, &key)); key++)
+		xa_art_add(new, key, *slot);
+
+	*ref = new;
+	xa_art_free(xa, node);
+
+	return new;
+}
+
+/*
+ * The node referred by @ref has lost a child. The node is replaced by its
+ * only child if it has one, or moved to the smaller type. The node is kept
+ * as it is when the smaller one can't be allocated.
+ */
+static void xa_art_shrink(struct xarray *xa, void **ref)
+{
+	struct xa_art_node *node = *ref;
+	unsigned int key = 0;
+
+	if (node->shift && node->count == 1) {
+		*ref = *xa_art_next(node, &key);
+		xa_art_free(xa, node);
+	} else if (node->count <= xa_art_classes[node->type].shrink) {
+		xa_art_resize(xa, ref, node->type - 1);
+	}
+}
+
+static void *xa_art_load(struct xarray *xa, unsigned long index)
+{
+	struct xa_art_node *node = xa->xa_head;
+	void **slot;
+
+	while (node) {
+		if (!xa_art_covers(node, index))
+			return NULL;
+
+		slot = xa_art_slot(node, xa_art_key(node, index));
+		if (!slot)
+			return NULL;
+		if (!node->shift)
+			return *slot;
+
+		node = *slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * A node of the lowest level is created for the new index, and it's linked
+ * to the node where the lookup stops. When the index isn't covered by that
+ * node, a new node is inserted above it at the highest level where their
+ * indexes differ.
+ */
+static void *xa_art_store(struct xarray *xa, unsigned long index, void *entry)
+{
+	struct xa_art_node *node, *new, *leaf = NULL;
+	void **ref = &xa->xa_head, **slot, *curr, *child = entry;
+	unsigned int shift;
+
+	for (;;) {
+		node = *ref;
+		if (!node || !xa_art_covers(node, index))
+			break;
+
+		slot = xa_art_slot(node, xa_art_key(node, index));
+		if (!slot)
+			break;
+
+		if (!node->shift) {
+			curr = *slot;
+			*slot = entry;
+			xa_account_entries(xa, entry_accounted(entry) -
+					       entry_accounted(curr));
+			return curr;
+		}
+
+		ref = slot;
+	}
+
+	if (!node || !xa_art_covers(node, index) || node->shift) {
+		leaf = xa_art_alloc(xa, XA_ART_4, 0, index);
+		if (!leaf)
+			return XA_ERROR(-ENOMEM);
+
+		xa_art_add(leaf, xa_art_key(leaf, index), entry);
+		child = leaf;
+	}
+
+	if (!node) {
+		*ref = leaf;
+	} else if (!xa_art_covers(node, index)) {
+		shift = ALIGN_DOWN(__fls(index ^ node->index), XA_ART_SHIFT);
+		new = xa_art_alloc(xa, XA_ART_4, shift, index);
+		if (!new)
+			goto nomem;
+
+		xa_art_add(new, xa_art_key(new, node->index), node);
+		xa_art_add(new, xa_art_key(new, index), leaf);
+		*ref = new;
+	} else {
+		if (node->count == xa_art_classes[node->type].capacity) {
+			node = xa_art_resize(xa, ref, node->type + 1);
+			if (!node)
+				goto nomem;
+		}
+
+		xa_art_add(node, xa_art_key(node, index), child);
+	}
+
+	xa_account_entries(xa, entry_accounted(entry));
+	return NULL;
+
+nomem:
+	if (leaf)
+		xa_art_free(xa, leaf);
+	return XA_ERROR(-ENOMEM);
+}
+
+/* The nodes left empty are released from the bottom up */
+static void *xa_art_erase(struct xarray *xa, unsigned long index)
+{
+	void **path[XA_ART_LEVELS], **slot, *curr;
+	struct xa_art_node *node;
+	int depth = 0;
+
+	path[0] = &xa->xa_head;
+	for (;;) {
+		node = *path[depth];
+		if (!node || !xa_art_covers(node, index))
+			return NULL;
+
+		slot = xa_art_slot(node, xa_art_key(node, index));
+		if (!slot)
+			return NULL;
+		if (!node->shift)
+			break;
+
+		path[++depth] = slot;
+	}
+
+	curr = *slot;
+	xa_account_entries(xa, -entry_accounted(curr));
+
+	for (;;) {
+		xa_art_remove(node, xa_art_key(node, index));
+		if (node->count)
+			break;
+
+		xa_art_free(xa, node);
+		if (!depth) {
+			xa->xa_head = NULL;
+			return curr;
+		}
+
+		node = *path[--depth];
+	}
+
+	xa_art_shrink(xa, path[depth]);
+	return curr;
+}
+
+/* The first entry in [*@indexp, @max] below @node */
+static void *xa_art_find(struct xa_art_node *node, unsigned long *indexp,
+			 unsigned long max)
+{
+	unsigned long base, index = *indexp;
+	unsigned int key;
+	void **slot, *entry;
+
+	if (index < node->index)
+		index = node->index;
+	else if (!xa_art_covers(node, index))
+		return NULL;
+
+	if (index > max)
+		return NULL;
+
+	for (key = xa_art_key(node, index);
+	     (slot = xa_art_next(node, &key)); key++) {
+		base = node->index + ((unsigned long)key << node->shift);
+		if (base > max)
+			break;
+		if (index < base)
+			index = base;
+
+		if (!node->shift) {
+			*indexp = index;
+			return *slot;
+		}
+
+		entry = xa_art_find(*slot, &index, max);
+		if (entry) {
+			*indexp = index;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void xa_art_destroy(struct xarray *xa, struct xa_art_node *node)
+{
+	unsigned int key;
+	void **slot;
+
+	for (key = 0; (slot = xa_art_next(node, &key)); key++) {
+		if (node->shift)
+			xa_art_destroy(xa, *slot);
+		else
+			xa_account_entries(xa, -entry_accounted(*slot));
+	}
+
+	xa_art_free(xa, node);
+}
+
+/******************* XArray public APIs */
+
+void xa_init_flags(struct xarray *xa, unsigned long flags)
 {
 	sem_init(&xa->sem, 0, 1);
+	xa->xa_flags = flags;
+	xa->xa_head = NULL;
+	xa->xa_gen = 1;
+	xa_seq_bump(xa);
+	memset(&xa->xa_account, 0, sizeof(xa->xa_account));
+	xa->xa_stats = NULL;
+	xa->xa_lockprof = NULL;
+	xa->xa_recorder = NULL;
+	xa->xa_regions = NULL;
+	xa_inline_init(xa);
+}
+
+void xa_init(struct xarray *xa)
+{
+	xa_init_flags(xa, 0);
+}
+
+void *xa_load(struct xarray *xa, unsigned long index)
+{
+	XA_STATE(xas, xa, index);
+	u64 start = xa_stat_start(xa);
+	void *entry;
+
+	xa_lock(xa);
+	xa_record(xa, XA_OP_LOAD, index, index, NULL, 0);
+
+	if (xa_adaptive(xa)) {
+		entry = xa_art_load(xa, index);
+		goto unlock;
+	}
+
+	if (xa_inlined(xa)) {
+		entry = xa_inline_load(xa, index);
+		goto unlock;
+	}
+
+	do {
+		if (xa_hinted(xa))
+			entry = xas_load_hint(&xas);
+		else
+			entry = xas_load(&xas);
+		if (xa_is_zero(entry))
+			entry = NULL;
+	} while (xa_retry(&xas, entry));
+
+	/* The packed leaf is found in the slot of its parent */
+	if (xas_is_node(&xas) && xa_is_packed(xa, xas.xa_node, entry))
+		entry = xa_packed_get(entry, index & XA_CHUNK_MASK);
+
+unlock:
+	xa_unlock(xa);
+
+	xa_stat_inc(xa, XA_STAT_LOAD);
+	xa_stat_time(xa, XA_HIST_LOAD, start);
+	return entry;
+}
+
+static void *__xa_store(struct xarray *xa, unsigned long index, void *entry,
+			const char *func)
+{
+	XA_STATE(xas, xa, index);
+	u64 start = xa_stat_start(xa);
+	void *curr;
+
+	if (xa_is_advanced(entry))
+		return XA_ERROR(-EINVAL);
+
+	if (xa_track_free(xa) && !entry)
+		entry = XA_ZERO_ENTRY;
+
+	__xa_lock(xa, func);
+	xa_record(xa, XA_OP_STORE, index, index, entry, 0);
+
+	if (xa_adaptive(xa)) {
+		if (entry)
+			curr = xa_art_store(xa, index, entry);
+		else
+			curr = xa_art_erase(xa, index);
+		goto unlock;
+	}
+
+	if (xa_inlined(xa) && xa_inline_store(xa, index, entry, &curr))
+		goto unlock;
+	if (xa_packed(xa) && xas_packed_update(&xas, entry, &curr))
+		goto unlock;
+
+	do {
+		if (xa_packed(xa))
+			xas_unpack(&xas);
+		curr = xas_store(&xas, entry);
+		if (xa_track_free(xa))
+			xas_clear_mark(&xas, XA_FREE_MARK);
+	} while (xas_nomem(&xas));
+
+	curr = xas_result(&xas, curr);
+	if (xa_packed(xa))
+		xas_pack(&xas);
+unlock:
+	xa_unlock(xa);
+
+	xa_stat_inc(xa, XA_STAT_STORE);
+	xa_stat_time(xa, XA_HIST_STORE, start);
+	return curr;
+}
+
+void *xa_store(struct xarray *xa, unsigned long index, void *entry)
+{
+	return __xa_store(xa, index, entry, __func__);
+}
+
+static void *__xa_store_range(struct xarray *xa, unsigned long first,
+			      unsigned long last, void *entry, const char *func)
+{
+	XA_STATE(xas, xa, 0);
+	unsigned int order;
+	bool recorded = false;
+
+	if (xa_is_internal(entry))
+		return XA_ERROR(-EINVAL);
+	if (last < first)
+		return XA_ERROR(-EINVAL);
+
+	/* The adaptive and packed arrays have no multi-index entries */
+	if (xa_adaptive(xa) || xa_packed(xa))
+		return XA_ERROR(-EINVAL);
+
+	do {
+		__xa_lock(xa, func);
+		if (!recorded) {
+			xa_record(xa, XA_OP_STORE_RANGE, first, last, entry, 0);
+			recorded = true;
+		}
+
+		if (entry) {
+			order = BITS_PER_LONG;
+			if (last + 1)
+				order = __ffs(last + 1);
+			xas_set_order(&xas, last, order);
+			xas_create(&xas, true);
+			if (xas_error(&xas))
+				goto unlock;
+		}
+
+		do {
+			xas_set_range(&xas, first, last);
+			xas_store(&xas, entry);
+			if (xas_error(&xas))
+				goto unlock;
+			first += xas_size(&xas);
+		} while (first && first <= last);	/* Mind the wrap */
+unlock:
+		xa_unlock(xa);
+	} while (xas_nomem(&xas));
+
+	xa_stat_inc(xa, XA_STAT_STORE);
+	return xas_result(&xas, NULL);
+}
+
+void *xa_store_range(struct xarray *xa, unsigned long first,
+		     unsigned long last, void *entry)
+{
+	return __xa_store_range(xa, first, last, entry, __func__);
+}
+
+void *xa_find(struct xarray *xa, unsigned long *indexp,
+	      unsigned long max, xa_mark_t filter)
+{
+	XA_STATE(xas, xa, *indexp);
+	void *entry;
+
+	xa_lock(xa);
+	xa_record(xa, XA_OP_FIND, *indexp, max, NULL, filter);
+
+	/* The adaptive, inline and packed arrays aren't marked */
+	if (xa_adaptive(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS && xa->xa_head)
+			entry = xa_art_find(xa->xa_head, &xas.xa_index, max);
+		goto unlock;
+	}
+
+	if (xa_inlined(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS)
+			entry = xa_inline_find(xa, &xas.xa_index, max);
+		goto unlock;
+	}
+
+	if (xa_packed(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS)
+			entry = xa_packed_find(xa, &xas.xa_index, max);
+		goto unlock;
+	}
+
+        do {
+		if ((__force unsigned int)filter < XA_MAX_MARKS)
+			entry = xas_find_marked(&xas, max, filter);
+		else
+			entry = xas_find(&xas, max);
+	} while (xa_retry(&xas, entry));
+
+unlock:
+	xa_unlock(xa);
+
+	if (entry)
+		*indexp = xas.xa_index;
+	return entry;
+}
+
+void *xa_find_after(struct xarray *xa, unsigned long *indexp,
+		    unsigned long max, xa_mark_t filter)
+{
+	XA_STATE(xas, xa, *indexp + 1);
+	void *entry;
+
+	if (xas.xa_index == 0)
+		return NULL;
+
+	xa_lock(xa);
+	xa_record(xa, XA_OP_FIND_AFTER, *indexp, max, NULL, filter);
+
+	if (xa_adaptive(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS && xa->xa_head)
+			entry = xa_art_find(xa->xa_head, &xas.xa_index, max);
+		goto unlock;
+	}
+
+	if (xa_inlined(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS)
+			entry = xa_inline_find(xa, &xas.xa_index, max);
+		goto unlock;
+	}
+
+	if (xa_packed(xa)) {
+		entry = NULL;
+		if ((__force unsigned int)filter >= XA_MAX_MARKS)
+			entry = xa_packed_find(xa, &xas.xa_index, max);
+		goto unlock;
+	}
+
+	for (;;) {
+		if ((__force unsigned int)filter < XA_MAX_MARKS)
+			entry = xas_find_marked(&xas, max, filter);
+		else
+			entry = xas_find(&xas, max);
+
+		if (xas_invalid(&xas))
+			break;
+		/* Every index of a coalesced entry is an entry of its own */
+		if (xas_is_sibling(&xas) && !xa_coalesced(xa))
+			continue;
+		if (!xa_retry(&xas, entry))
+			break;
+	}
+
+unlock:
+	xa_unlock(xa);
+
+	if (entry)
+		*indexp = xas.xa_index;
+	return entry;
+}
+
+/* The adaptive, inline and packed arrays are never marked */
+static void *xa_find_unmarked(struct xarray *xa, unsigned long *indexp,
+			      unsigned long max, xa_marks_t expr)
+{
+	if (!(expr & 1U))
+		return NULL;
+	if (xa_inlined(xa))
+		return xa_inline_find(xa, indexp, max);
+	if (xa_packed(xa))
+		return xa_packed_find(xa, indexp, max);
+	if (xa->xa_head)
+		return xa_art_find(xa->xa_head, indexp, max);
+
+	return NULL;
+}
+
+void *xa_find_marks(struct xarray *xa, unsigned long *indexp,
+		    unsigned long max, xa_marks_t expr)
+{
+	XA_STATE(xas, xa, *indexp);
+	void *entry;
+
+	xa_lock(xa);
+
+	if (xa_adaptive(xa) || xa_inlined(xa) || xa_packed(xa)) {
+		entry = xa_find_unmarked(xa, &xas.xa_index, max, expr);
+		goto unlock;
+	}
+
+	do {
+		entry = xas_find_marks(&xas, max, expr);
+	} while (xa_retry(&xas, entry));
+
+unlock:
+	xa_unlock(xa);
+
+	if (entry)
+		*indexp = xas.xa_index;
+	return entry;
+}
+
+void *xa_find_marks_after(struct xarray *xa, unsigned long *indexp,
+			  unsigned long max, xa_marks_t expr)
+{
+	XA_STATE(xas, xa, *indexp + 1);
+	void *entry;
+
+	if (xas.xa_index == 0)
+		return NULL;
+
+	xa_lock(xa);
+
+	if (xa_adaptive(xa) || xa_inlined(xa) || xa_packed(xa)) {
+		entry = xa_find_unmarked(xa, &xas.xa_index, max, expr);
+		goto unlock;
+	}
+
+	for (;;) {
+		entry = xas_find_marks(&xas, max, expr);
+		if (xas_invalid(&xas))
+			break;
+		if (xas_is_sibling(&xas) && !xa_coalesced(xa))
+			continue;
+		if (!xa_retry(&xas, entry))
+			break;
+	}
+
+unlock:
+	xa_unlock(xa);
+
+	if (entry)
+		*indexp = xas.xa_index;
+	return entry;
+}
+
+int xa_get_order(struct xarray *xa, unsigned long index)
+{
+	XA_STATE(xas, xa, index);
+	void *entry;
+	int order = 0;
+	unsigned int slot;
+
+	xa_lock(xa);
+
+	/* The packed arrays have no multi-index entries */
+	if (xa_inlined(xa) || xa_adaptive(xa) || xa_packed(xa))
+		goto unlock;
+
+	entry = xas_load(&xas);
+	if (!entry)
+		goto unlock;
+
+	if (!xas.xa_node)
+		goto unlock;
+
+	for (;;) {
+		slot = xas.xa_offset + (1 << order);
+
+		if (slot >= XA_CHUNK_SIZE)
+			break;
+		if (!xa_is_sibling(xas.xa_node->slots[slot]))
+			break;
+		order++;
+	}
+
+	order += xas.xa_node->shift;
+unlock:
+	xa_unlock(xa);
+
+	return order;
+}
+
+/* The indexes of [@start, @end] which are within [@first, @last] */
+static inline unsigned long range_overlap(unsigned long start,
+					  unsigned long end,
+					  unsigned long first,
+					  unsigned long last)
+{
+	if (start < first)
+		start = first;
+	if (end > last)
+		end = last;
+	return end - start + 1;
+}
+
+/*
+ * The indexes of @node which are within the range. Every slot of a
+ * multi-index entry adds its own indexes.
+ */
+static unsigned long node_count_range(const struct xarray *xa,
+				      const struct xa_node *node,
+				      unsigned long first, unsigned long last)
+{
+	unsigned long nr = 0, start, end;
+	unsigned int offset;
+	void *entry;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		start = node->index + ((unsigned long)offset << node->shift);
+		end = start + (1UL << node->shift) - 1;
+		if (end < first)
+			continue;
+		if (start > last)
+			break;
+
+		entry = xa_entry(xa, node, offset);
+		if (xa_is_sibling(entry))
+			entry = xa_entry(xa, node, xa_to_sibling(entry));
+
+		if (!xa_is_node(entry)) {
+			if (entry_accounted(entry))
+				nr += range_overlap(start, end, first, last);
+		} else if (start >= first && end <= last &&
+			   node_totalled(xa_to_node(entry))) {
+			nr += xa_to_node(entry)->total;
+		} else {
+			nr += node_count_range(xa, xa_to_node(entry),
+					       first, last);
+		}
+	}
+
+	return nr;
+}
+
+/* The indexes of the entry at @xas which are within the range */
+static unsigned long xas_count_span(const struct xa_state *xas,
+				    unsigned long first, unsigned long last)
+{
+	struct xa_node *node = xas->xa_node;
+	unsigned int offset = xas->xa_offset;
+	unsigned long start, end;
+
+	if (xas_not_node(node))
+		return 1;
+
+	start = node->index + ((unsigned long)offset << node->shift);
+	while (++offset < XA_CHUNK_SIZE &&
+	       xa_is_sibling(xa_entry(xas->xa, node, offset)))
+		;
+	end = node->index + ((unsigned long)offset << node->shift) - 1;
+
+	return range_overlap(start, end, first, last);
+}
+
+/* Visit the entries of the arrays which don't keep the counters */
+static unsigned long xa_count_scan(struct xarray *xa, unsigned long first,
+				   unsigned long last)
+{
+	XA_STATE(xas, xa, first);
+	unsigned long nr = 0, index = first;
+	void *entry;
+
+	if (xa_adaptive(xa) || xa_inlined(xa) || xa_packed(xa)) {
+		for (;;) {
+			if (xa_inlined(xa))
+				entry = xa_inline_find(xa, &index, last);
+			else if (xa_packed(xa))
+				entry = xa_packed_find(xa, &index, last);
+			else if (xa->xa_head)
+				entry = xa_art_find(xa->xa_head, &index, last);
+			else
+				entry = NULL;
+			if (!entry)
+				break;
+
+			nr++;
+			if (index++ == last)
+				break;
+		}
+
+		return nr;
+	}
+
+	for (entry = xas_find(&xas, last); entry;
+	     entry = xas_find(&xas, last)) {
+		if (entry_accounted(entry))
+			nr += xas_count_span(&xas, first, last);
+	}
+
+	return nr;
+}
+
+static unsigned long __xa_count_range(struct xarray *xa, unsigned long first,
+				      unsigned long last, const char *func)
+{
+	unsigned long nr;
+	void *head;
+
+	if (last < first)
+		return 0;
+
+	__xa_lock(xa, func);
+
+	head = xa_head(xa);
+	if (!xa_counted(xa) || xa_adaptive(xa) || xa_inlined(xa))
+		nr = xa_count_scan(xa, first, last);
+	else if (xa_is_node(head))
+		nr = node_count_range(xa, xa_to_node(head), first, last);
+	else
+		nr = !first && entry_accounted(head);
+
+	xa_unlock(xa);
+
+	return nr;
+}
+
+unsigned long xa_count_range(struct xarray *xa, unsigned long first,
+			     unsigned long last)
+{
+	return __xa_count_range(xa, first, last, __func__);
+}
+
+unsigned long xa_rank(struct xarray *xa, unsigned long index)
+{
+	return index ? __xa_count_range(xa, 0, index - 1, __func__) : 0;
+}
+
+static void *__xa_erase(struct xarray *xa, unsigned long index,
+			const char *func)
+{
+	XA_STATE(xas, xa, index);
+	void *entry;
+
+	__xa_lock(xa, func);
+	xa_record(xa, XA_OP_ERASE, index, index, NULL, 0);
+
+	if (xa_adaptive(xa)) {
+		entry = xa_art_erase(xa, index);
+	} else if (xa_inlined(xa)) {
+		xa_inline_store(xa, index, NULL, &entry);
+	} else if (!xa_packed(xa) || !xas_packed_update(&xas, NULL, &entry)) {
+		/* The coalesced entry is split to erase one index */
+		do {
+			if (xa_packed(xa))
+				xas_unpack(&xas);
+			entry = xas_store(&xas, NULL);
+		} while (xas_nomem(&xas));
+
+		entry = xas_result(&xas, entry);
+		if (xa_packed(xa))
+			xas_pack(&xas);
+	}
+
+	xa_unlock(xa);
+
+	xa_stat_inc(xa, XA_STAT_ERASE);
+	return entry;
+}
+
+void *xa_erase(struct xarray *xa, unsigned long index)
+{
+	return __xa_erase(xa, index, __func__);
+}
+
+bool xa_get_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+	XA_STATE(xas, xa, index);
+	void *entry;
+
+	xa_lock(xa);
+	xa_record(xa, XA_OP_GET_MARK, index, index, NULL, mark);
+
+	if (xa_inlined(xa) || xa_adaptive(xa) || xa_packed(xa)) {
+		xa_unlock(xa);
+		return false;
+	}
+
+	entry = xas_start(&xas);
+	while (xas_get_mark(&xas, mark)) {
+		if (!xa_is_node(entry)) {
+			xa_unlock(xa);
+			return true;
+		}
+
+		entry = xas_descend(&xas, xa_to_node(entry));
+		if (!entry)
+			break;
+	}
+
+	xa_unlock(xa);
+
+        return false;
+}
+
+/*
+ * The mark of one index of a coalesced entry can't change without the
+ * others, so the entry is split down to the index first.
+ */
+static void *xas_split_mark(struct xa_state *xas, xa_mark_t mark, bool set)
+{
+	void *entry;
+
+	do {
+		entry = xas_load(xas);
+		if (!entry || !xas_multi(xas) || xas_get_mark(xas, mark) == set)
+			break;
+
+		entry = xas_create(xas, true);
+	} while (xas_nomem(xas));
+
+	xas_destroy(xas);
+	return xas_invalid(xas) ? NULL : entry;
+}
+
+void xa_set_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+	XA_STATE(xas, xa, index);
+	void *entry;
+
+        xa_lock(xa);
+	xa_record(xa, XA_OP_SET_MARK, index, index, NULL, mark);
+
+	/* The marked entry has to be moved to the tree */
+	entry = NULL;
+	if (xa_coalesced(xa) && !xa_inlined(xa))
+		entry = xas_split_mark(&xas, mark, true);
+	else if (!xa_adaptive(xa) && !xa_packed(xa) &&
+		 (!xa_inlined(xa) || xa_inline_load(xa, index)))
+		entry = xas_load(&xas);
+	if (entry)
+		xas_set_mark(&xas, mark);
+	if (entry && xa_coalesced(xa) && !xas_not_node(xas.xa_node))
+		xas_coalesce(&xas, entry);
+
+	xa_unlock(xa);
+}
+
+void xa_clear_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+	XA_STATE(xas, xa, index);
+	void *entry;
+
+	xa_lock(xa);
+	xa_record(xa, XA_OP_CLEAR_MARK, index, index, NULL, mark);
+
+	entry = NULL;
+	if (xa_coalesced(xa) && !xa_inlined(xa))
+		entry = xas_split_mark(&xas, mark, false);
+	else if (!xa_inlined(xa) && !xa_adaptive(xa) && !xa_packed(xa))
+		entry = xas_load(&xas);
+	if (entry)
+		xas_clear_mark(&xas, mark);
+	if (entry && xa_coalesced(xa) && !xas_not_node(xas.xa_node))
+		xas_coalesce(&xas, entry);
+
+	xa_unlock(xa);
+}
+
+/*
+ * Set @mark on the entries of @node within the range which have @filter,
+ * and tell if the node has the mark then. The mark bits of a node are
+ * changed in one go, so every parent bit is fixed once for each node.
+ */
+static bool node_set_mark_range(struct xarray *xa, struct xa_node *node,
+				unsigned long first, unsigned long last,
+				xa_mark_t mark, xa_mark_t filter)
+{
+	unsigned long bits = 0, start, end;
+	unsigned int offset, canon;
+	bool head = true;
+	void *entry;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		start = node->index + ((unsigned long)offset << node->shift);
+		end = start + (1UL << node->shift) - 1;
+		if (end < first)
+			continue;
+		if (start > last)
+			break;
+
+		/* The entry reaching in from below the range is marked too */
+		canon = offset;
+		entry = xa_entry(xa, node, offset);
+		if (xa_is_sibling(entry)) {
+			if (!head)
+				continue;
+			canon = xa_to_sibling(entry);
+			entry = xa_entry(xa, node, canon);
+		}
+		head = false;
+
+		if (!entry)
+			continue;
+		if ((__force unsigned int)filter < XA_MAX_MARKS &&
+		    !node_get_mark(node, canon, filter))
+			continue;
+
+		if (!xa_is_node(entry) ||
+		    node_set_mark_range(xa, xa_to_node(entry), first, last,
+					mark, filter))
+			bits |= 1UL << canon;
+	}
+
+	node_marks(node, mark)[0] |= bits;
+	return node_any_mark(node, mark);
+}
+
+/* Clear @mark in the range, and tell if the node still has the mark */
+static bool node_clear_mark_range(struct xarray *xa, struct xa_node *node,
+				  unsigned long first, unsigned long last,
+				  xa_mark_t mark)
+{
+	unsigned long bits = 0, start, end;
+	unsigned int offset, canon;
+	bool head = true;
+	void *entry;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
+		start = node->index + ((unsigned long)offset << node->shift);
+		end = start + (1UL << node->shift) - 1;
+		if (end < first)
+			continue;
+		if (start > last)
+			break;
+
+		canon = offset;
+		entry = xa_entry(xa, node, offset);
+		if (xa_is_sibling(entry)) {
+			if (!head)
+				continue;
+			canon = xa_to_sibling(entry);
+			entry = xa_entry(xa, node, canon);
+		}
+		head = false;
+
+		/* The subtrees without the mark are skipped */
+		if (!node_get_mark(node, canon, mark))
+			continue;
+
+		if (!xa_is_node(entry) ||
+		    !node_clear_mark_range(xa, xa_to_node(entry), first, last,
+					   mark))
+			bits |= 1UL << canon;
+	}
+
+	node_marks(node, mark)[0] &= ~bits;
+	return node_any_mark(node, mark);
+}
+
+/*
+ * The marks of the indexes out of the range mustn't change with the
+ * coalesced entries crossing the ends of the range, which are split.
+ */
+static void xa_split_mark_range(struct xarray *xa, unsigned long first,
+				unsigned long last, xa_mark_t mark, bool set)
+{
+	XA_STATE(xas, xa, first);
+
+	if (!xa_coalesced(xa))
+		return;
+
+	xas_split_mark(&xas, mark, set);
+	xas_set(&xas, last);
+	xas_split_mark(&xas, mark, set);
+}
+
+/*
+ * Mark the entries in the range which have @filter, or all of them with
+ * XA_PRESENT. The inline entries are moved to the tree to be marked.
+ */
+static void __xa_set_mark_range(struct xarray *xa, unsigned long first,
+				unsigned long last, xa_mark_t mark,
+				xa_mark_t filter, const char *func)
+{
+	unsigned long index = first;
+	void *head;
+
+	if (last < first || xa_adaptive(xa) || xa_packed(xa))
+		return;
+
+	__xa_lock(xa, func);
+
+	if (xa_inlined(xa)) {
+		if ((__force unsigned int)filter < XA_MAX_MARKS ||
+		    !xa_inline_find(xa, &index, last) ||
+		    xa_inline_promote(xa))
+			goto unlock;
+	}
+
+	xa_split_mark_range(xa, first, last, mark, true);
+
+	head = xa_head(xa);
+	if (xa_is_node(head)) {
+		if (node_set_mark_range(xa, xa_to_node(head), first, last,
+					mark, filter))
+			xa_mark_set(xa, mark);
+	} else if (head && !first) {
+		if ((__force unsigned int)filter >= XA_MAX_MARKS ||
+		    xa_marked(xa, filter))
+			xa_mark_set(xa, mark);
+	}
+
+unlock:
+	xa_unlock(xa);
+}
+
+void xa_set_mark_range(struct xarray *xa, unsigned long first,
+		       unsigned long last, xa_mark_t mark)
+{
+	__xa_set_mark_range(xa, first, last, mark, XA_PRESENT, __func__);
+}
+
+/* Like tag_pages_for_writeback(), @to is set where @from is */
+void xa_tag_marked_range(struct xarray *xa, unsigned long first,
+			 unsigned long last, xa_mark_t from, xa_mark_t to)
+{
+	__xa_set_mark_range(xa, first, last, to, from, __func__);
+}
+
+void xa_clear_mark_range(struct xarray *xa, unsigned long first,
+			 unsigned long last, xa_mark_t mark)
+{
+	void *head;
+
+	if (last < first)
+		return;
+
+	xa_lock(xa);
+
+	/* The adaptive, inline and packed arrays aren't marked */
+	if (xa_adaptive(xa) || xa_inlined(xa) || xa_packed(xa))
+		goto unlock;
+
+	xa_split_mark_range(xa, first, last, mark, false);
+
+	head = xa_head(xa);
+	if (xa_is_node(head)) {
+		if (xa_marked(xa, mark) &&
+		    !node_clear_mark_range(xa, xa_to_node(head), first, last,
+					   mark))
+			xa_mark_clear(xa, mark);
+	} else if (!first) {
+		xa_mark_clear(xa, mark);
+	}
+
+unlock:
+	xa_unlock(xa);
+}
+
+/* Free all nodes and entries, but the array can be reused */
+static void __xa_destroy(struct xarray *xa, const char *func)
+{
+	XA_STATE(xas, xa, 0);
+	void *entry;
+
+	__xa_lock(xa, func);
+
+	if (xa_inlined(xa)) {
+		while (xa->xa_nr_inline)
+			xa_inline_store(xa, xa->xa_inline[0].index, NULL, &entry);
+	}
+
+	entry = xa_head(xa);
 	xa->xa_head = NULL;
+	if (xa_adaptive(xa)) {
+		if (entry)
+			xa_art_destroy(xa, entry);
+	} else if (xa_is_node(entry)) {
+		xas_free_nodes(&xas, xa_to_node(entry));
+	} else if (entry_accounted(entry)) {
+		xa_account_entries(xa, -1);
+	}
+
+	xas.xa_node = NULL;
+	xas_init_marks(&xas);
+	xa_regions_release(xa);
+	xa_inline_init(xa);
+
+	xa_unlock(xa);
+}
+
+void xa_destroy(struct xarray *xa)
+{
+	__xa_destroy(xa, __func__);
+}
+
+void xa_set_budget(struct xarray *xa, unsigned long bytes)
+{
+	xa_lock(xa);
+	xa->xa_account.budget = bytes;
+	xa_unlock(xa);
+}
+
+void xa_get_account(struct xarray *xa, struct xa_account *account)
+{
+	struct xa_regions *regions;
+
+	xa_lock(xa);
+	*account = xa->xa_account;
+	regions = xa->xa_regions;
+	if (regions) {
+		sem_wait(&regions->sem);
+		account->nr_regions = regions->nr_regions;
+		sem_post(&regions->sem);
+	}
+	xa_unlock(xa);
+}
+
+/*
+ * The statistics can be enabled at any time, but they can be disabled only
+ * when nobody is accessing the array.
+ */
+int xa_stats_enable(struct xarray *xa)
+{
+	struct xa_stats_slot *stats;
+	size_t size = XA_STATS_SLOTS * sizeof(*stats);
+
+	if (posix_memalign((void **)&stats, SMP_CACHE_BYTES, size))
+		return -ENOMEM;
+
+	memset(stats, 0, size);
+
+	xa_lock(xa);
+	if (!xa->xa_stats) {
+		WRITE_ONCE(xa->xa_stats, stats);
+		stats = NULL;
+	}
+	xa_unlock(xa);
+
+	free(stats);
+	return 0;
+}
+
+void xa_stats_disable(struct xarray *xa)
+{
+	struct xa_stats_slot *stats;
+
+	xa_lock(xa);
+	stats = xa->xa_stats;
+	WRITE_ONCE(xa->xa_stats, NULL);
+	xa_unlock(xa);
+
+	free(stats);
+}
+
+void xa_stats_read(struct xarray *xa, struct xa_stats *stats)
+{
+	struct xa_stats_slot *slot;
+	unsigned int i, j, k;
+
+	memset(stats, 0, sizeof(*stats));
+
+	xa_lock(xa);
+
+	for (i = 0; xa->xa_stats && i < XA_STATS_SLOTS; i++) {
+		slot = &xa->xa_stats[i];
+		for (j = 0; j < XA_STAT_NR_ITEMS; j++)
+			stats->items[j] += __atomic_load_n(&slot->items[j],
+							   __ATOMIC_RELAXED);
+		for (j = 0; j < XA_HIST_NR; j++) {
+			for (k = 0; k < XA_STAT_BUCKETS; k++) {
+				stats->hist[j][k] += __atomic_load_n(
+					&slot->hist[j][k], __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	xa_unlock(xa);
+}
+
+/*
+ * Same as the statistics, the lock profiling can be disabled only when
+ * nobody is accessing the array.
+ */
+int xa_lock_stats_enable(struct xarray *xa)
+{
+	struct xa_lock_prof *prof = calloc(1, sizeof(*prof));
+
+	if (!prof)
+		return -ENOMEM;
+
+	xa_lock(xa);
+	if (!xa->xa_lockprof) {
+		WRITE_ONCE(xa->xa_lockprof, prof);
+		prof = NULL;
+	}
+	xa_unlock(xa);
+
+	free(prof);
+	return 0;
+}
+
+void xa_lock_stats_disable(struct xarray *xa)
+{
+	struct xa_lock_prof *prof;
+
+	xa_lock(xa);
+	prof = xa->xa_lockprof;
+	if (prof)
+		prof->holder = NULL;
+	WRITE_ONCE(xa->xa_lockprof, NULL);
+	xa_unlock(xa);
+
+	free(prof);
+}
+
+void xa_lock_stats_read(struct xarray *xa, struct xa_lock_stats *stats)
+{
+	xa_lock(xa);
+
+	if (xa->xa_lockprof)
+		*stats = xa->xa_lockprof->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+
+	xa_unlock(xa);
+}
+
+/*
+ * The calls are recorded to @fp until xa_record_stop(), which flushes
+ * the buffered records. @fp isn't closed by the recorder.
+ */
+int xa_record_start(struct xarray *xa, FILE *fp)
+{
+	struct xa_recorder *rec = calloc(1, sizeof(*rec));
+	struct xa_record_header header = {
+		.magic		= XA_RECORD_MAGIC,
+		.version	= XA_RECORD_VERSION,
+		.size		= sizeof(struct xa_record),
+		.flags		= xa->xa_flags,
+	};
+	int ret = 0;
+
+	if (!rec)
+		return -ENOMEM;
+
+	rec->fp = fp;
+
+	xa_lock(xa);
+
+	if (xa->xa_recorder)
+		ret = -EBUSY;
+	else if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		ret = -EIO;
+	else
+		WRITE_ONCE(xa->xa_recorder, rec);
+
+	xa_unlock(xa);
+
+	if (ret)
+		free(rec);
+	return ret;
+}
+
+int xa_record_stop(struct xarray *xa)
+{
+	struct xa_recorder *rec;
+	int ret;
+
+	xa_lock(xa);
+	rec = xa->xa_recorder;
+	WRITE_ONCE(xa->xa_recorder, NULL);
+	xa_unlock(xa);
+
+	if (!rec)
+		return -EINVAL;
+
+	ret = xa_recorder_flush(rec);
+	if (!ret && fflush(rec->fp))
+		ret = -EIO;
+
+	free(rec);
+	return ret;
+}
+
+/******************* XArray checkpoint */
+
+/*
+ * The checkpoint stream starts with a header, which is followed by the
+ * records and terminated by a record whose @first is larger than @last.
+ * Each record covers the index range [@first, @last], which is populated
+ * with @entry or erased when @entry is NULL. A full checkpoint has zero
+ * as @base and covers every node, while an incremental checkpoint only
+ * covers the nodes changed since the checkpoint of generation @base.
+ * The entries are saved as they are, meaning the pointer entries only
+ * make sense to the reader when they're translated by the caller.
+ *
+ * The ranges of a coalescing array are sets of independent indexes,
+ * while the others are multi-index entries, which a store to one of
+ * their indexes replaces as a whole. So a checkpoint is only restored to
+ * an array which coalesces if and only if the source did.
+ */
+#define XA_CKPT_MAGIC		0x58414350	/* "XACP" */
+#define XA_CKPT_VERSION		2
+#define XA_CKPT_COALESCED	1U	/* Taken from a coalescing array */
+
+struct xa_ckpt_header {
+	u32	magic;
+	u32	version;
+	u32	flags;		/* XA_CKPT_* */
+	u32	pad;
+	u64	base;		/* Generation it applies on, 0 if full */
+	u64	gen;		/* Generation of the checkpoint */
+	u64	span;		/* Maximal index covered by the head */
+	u64	head;		/* Head entry if it isn't a node */
+};
+
+struct xa_ckpt_record {
+	u64	first;
+	u64	last;
+	u64	entry;
+};
+
+static int xa_ckpt_write(FILE *fp, unsigned long first,
+			 unsigned long last, void *entry)
+{
+	struct xa_ckpt_record rec = {
+		.first = first,
+		.last  = last,
+		.entry = (u64)entry,
+	};
+
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+/* The parts of the slot beside the compressed node are empty */
+static int xa_ckpt_gaps(struct xa_node *child, unsigned long first,
+			unsigned long last, FILE *fp)
+{
+	unsigned long child_last;
+	int ret;
+
+	child_last = child->index + (XA_CHUNK_SIZE << child->shift) - 1;
+	if (child->index > first) {
+		ret = xa_ckpt_write(fp, first, child->index - 1, NULL);
+		if (ret)
+			return ret;
+	}
+
+	if (child_last < last)
+		return xa_ckpt_write(fp, child_last + 1, last, NULL);
+
+	return 0;
+}
+
+static int xa_ckpt_node(struct xarray *xa, struct xa_node *node,
+			bool full, FILE *fp)
+{
+	unsigned int offset, next;
+	unsigned long first, last;
+	void *entry;
+	int ret;
+
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset = next) {
+		entry = xa_entry(xa, node, offset);
+		first = node->index + ((unsigned long)offset << node->shift);
+		next = offset + 1;
+
+		if (xa_is_node(entry)) {
+			struct xa_node *child = xa_to_node(entry);
+
+			if (!full && child->gen != xa->xa_gen)
+				continue;
+
+			last = first + (1UL << node->shift) - 1;
+			ret = xa_ckpt_gaps(child, first, last, fp);
+			if (ret)
+				return ret;
+
+			ret = xa_ckpt_node(xa, child, full, fp);
+			if (ret)
+				return ret;
+
+			continue;
+		}
+
+		/* Merge the sibling entries, or the adjacent empty slots */
+		while (next < XA_CHUNK_SIZE) {
+			void *curr = xa_entry(xa, node, next);
+
+			if (entry ? !xa_is_sibling(curr) : !!curr)
+				break;
+
+			next++;
+		}
+
+		if (xa_is_zero(entry))
+			entry = NULL;
+		last = node->index + ((unsigned long)next << node->shift) - 1;
+		ret = xa_ckpt_write(fp, first, last, entry);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int __xa_checkpoint(struct xarray *xa, FILE *fp, bool full,
+			   const char *func)
+{
+	struct xa_ckpt_header hdr;
+	void *head;
+	int ret = 0;
+
+	__xa_lock(xa, func);
+
+	if (xa_adaptive(xa) || xa_packed(xa)) {
+		ret = -EOPNOTSUPP;
+		goto unlock;
+	}
+
+	if (xa_inlined(xa)) {
+		ret = xa_inline_promote(xa);
+		if (ret)
+			goto unlock;
+	}
+
+	head = xa_head(xa);
+	hdr.magic = XA_CKPT_MAGIC;
+	hdr.version = XA_CKPT_VERSION;
+	hdr.flags = xa_coalesced(xa) ? XA_CKPT_COALESCED : 0;
+	hdr.pad = 0;
+	hdr.base = full ? 0 : xa->xa_gen - 1;
+	hdr.gen = xa->xa_gen;
+	hdr.span = max_index(head);
+	hdr.head = xa_is_node(head) ? 0 : (u64)head;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		ret = -EIO;
+		goto unlock;
+	}
+
+	if (xa_is_node(head) &&
+	    (full || xa_to_node(head)->gen == xa->xa_gen)) {
+		ret = xa_ckpt_node(xa, xa_to_node(head), full, fp);
+		if (ret)
+			goto unlock;
+	}
+
+	ret = xa_ckpt_write(fp, 1, 0, NULL);
+	if (ret)
+		goto unlock;
+
+	/* The following changes belong to the next checkpoint */
+	xa->xa_gen++;
+unlock:
+	xa_unlock(xa);
+
+	return ret;
+}
+
+int xa_checkpoint(struct xarray *xa, FILE *fp)
+{
+	return __xa_checkpoint(xa, fp, true, __func__);
+}
+
+int xa_checkpoint_incremental(struct xarray *xa, FILE *fp)
+{
+	return __xa_checkpoint(xa, fp, false, __func__);
+}
+
+static int xa_restore_range(struct xarray *xa, unsigned long first,
+			    unsigned long last, void *entry, const char *func)
+{
+	void *curr;
+
+	if (xa_is_zero(entry))
+		entry = NULL;
+
+	if (first == last)
+		curr = __xa_store(xa, first, entry, func);
+	else
+		curr = __xa_store_range(xa, first, last, entry, func);
+
+	return xa_err(curr);
+}
+
+/*
+ * Replay one checkpoint on the array. The full checkpoint can be applied
+ * at any time, but the incremental one has to be applied on top of the
+ * checkpoint it was taken against.
+ */
+int xa_restore(struct xarray *xa, FILE *fp)
+{
+	struct xa_ckpt_header hdr;
+	struct xa_ckpt_record rec;
+	unsigned long span;
+	int ret;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		return -EIO;
+	if (hdr.magic != XA_CKPT_MAGIC || hdr.version != XA_CKPT_VERSION)
+		return -EINVAL;
+	if (!(hdr.flags & XA_CKPT_COALESCED) != !xa_coalesced(xa))
+		return -EINVAL;
+	if (hdr.base && hdr.base != xa->xa_gen - 1)
+		return -EINVAL;
+	if (xa_adaptive(xa) || xa_packed(xa))
+		return -EOPNOTSUPP;
+
+	/* The span is told by the tree */
+	xa_lock(xa);
+	ret = xa_inlined(xa) ? xa_inline_promote(xa) : 0;
+	xa_unlock(xa);
+	if (ret)
+		return ret;
+
+	/* The entries beyond the head's span have been dropped */
+	span = max_index(xa_head(xa));
+	if (span > hdr.span) {
+		ret = xa_restore_range(xa, hdr.span + 1, span, NULL,
+				       __func__);
+		if (ret)
+			return ret;
+	}
+
+	if (!hdr.span) {
+		ret = xa_restore_range(xa, 0, 0, (void *)hdr.head,
+				       __func__);
+		if (ret)
+			return ret;
+	}
+
+	for (;;) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1)
+			return -EIO;
+		if (rec.first > rec.last)
+			break;
+
+		ret = xa_restore_range(xa, rec.first, rec.last,
+				       (void *)rec.entry, __func__);
+		if (ret)
+			return ret;
+	}
+
+	xa->xa_gen = hdr.gen + 1;
+
+	return 0;
+}
+
+/******************* XArray bulk build */
+
+/*
+ * xa_build_sorted() builds the tree bottom-up, a level at a time. The
+ * leaves are filled from the entries, then every level groups the nodes
+ * of the level below by their slots in the parent. With threads, the
+ * entries are split at the boundaries of the subtrees which span
+ * xa_builder::shift bits. The threads build the subtrees, and the caller
+ * builds the levels above them. The nodes are accounted once the tree
+ * is built.
+ */
+#define XA_BUILD_BATCH		(1UL << 16)	/* Minimal entries per thread */
+
+struct xa_builder {
+	struct xarray		*xa;
+	const unsigned long	*indexes;
+	void * const		*entries;
+	struct xa_node		**nodes;	/* Subtrees being built */
+	unsigned int		top;		/* Shift of the head */
+	unsigned int		shift;		/* Shift built by the parts */
+	long			nr_nodes;	/* Nodes built */
+	pthread_mutex_t		lock;		/* Node regions */
+};
+
+struct xa_build_part {
+	struct xa_builder	*b;
+	pthread_t		thread;
+	bool			threaded;
+	unsigned long		first;		/* First entry */
+	unsigned long		nr;		/* Entries, then subtrees */
+	struct xa_node		**nodes;	/* Subtrees of the part */
+	long			nr_entries;	/* Accounted entries */
+	int			err;
+};
+
+/* The entry is the first one of its leaf */
+static inline bool xa_build_leaf(const unsigned long *indexes,
+				 unsigned long i)
+{
+	return !i || (indexes[i] ^ indexes[i - 1]) >> XA_CHUNK_SHIFT;
+}
+
+static struct xa_node *xa_build_alloc(struct xa_builder *b,
+				      unsigned int shift, unsigned long index)
+{
+	struct xarray *xa = b->xa;
+	struct xa_node *node;
+	long nr;
+
+	nr = __atomic_add_fetch(&b->nr_nodes, 1, __ATOMIC_RELAXED);
+	if (__xa_over_budget(xa, nr * sizeof(*node)))
+		return NULL;
+
+	/* The node regions aren't thread-safe */
+	if (xa_huge(xa))
+		pthread_mutex_lock(&b->lock);
+	node = xa_node_alloc(xa);
+	if (xa_huge(xa))
+		pthread_mutex_unlock(&b->lock);
+	if (!node)
+		return NULL;
+
+	node->shift = shift;
+	node->index = node_base(index, shift);
+	node->array = xa;
+	node->gen = xa->xa_gen;
+	xa_stat_inc(xa, XA_STAT_NODE_ALLOC);
+
+	return node;
+}
+
+static void xa_build_release(struct xa_builder *b, struct xa_node *node)
+{
+	__atomic_fetch_sub(&b->nr_nodes, 1, __ATOMIC_RELAXED);
+	if (xa_huge(b->xa))
+		pthread_mutex_lock(&b->lock);
+	xa_node_release(b->xa, node);
+	if (xa_huge(b->xa))
+		pthread_mutex_unlock(&b->lock);
+}
+
+/* Release a subtree which hasn't been linked to the array */
+static void xa_build_free(struct xa_builder *b, struct xa_node *node)
+{
+	unsigned int offset;
+	void *entry;
+
+	for (offset = 0; node->shift && offset < XA_CHUNK_SIZE; offset++) {
+		entry = node->slots[offset];
+		if (xa_is_node(entry))
+			xa_build_free(b, xa_to_node(entry));
+	}
+
+	xa_build_release(b, node);
+}
+
+/* The entry of a child whose slots are all the same, like xas_coalesce() */
+static void *xa_build_uniform(const struct xarray *xa,
+			      const struct xa_node *child, unsigned int shift)
+{
+	unsigned int offset;
+	void *entry = child->slots[0];
+
+	if (!xa_coalesced(xa) || child->count != XA_CHUNK_SIZE ||
+	    child->shift + XA_CHUNK_SHIFT != shift || xa_is_node(entry))
+		return NULL;
+
+	for (offset = 1; offset < XA_CHUNK_SIZE; offset++) {
+		if (child->slots[offset] != entry)
+			return NULL;
+	}
+
+	return entry;
+}
+
+static void xa_build_link(struct xa_build_part *part, struct xa_node *node,
+			  struct xa_node *child)
+{
+	struct xarray *xa = part->b->xa;
+	unsigned int offset = get_offset(node, child->index);
+	void *entry = xa_build_uniform(xa, child, node->shift);
+
+	node->count++;
+	if (entry) {
+		node->slots[offset] = entry;
+		node->nr_values += xa_is_value(entry);
+		part->nr_entries -= XA_CHUNK_SIZE - 1;
+		xa_build_release(part->b, child);
+		return;
+	}
+
+	node->slots[offset] = xa_mk_node(child);
+	node->total += child->total;
+	child->parent = node;
+	child->offset = offset;
+}
+
+/*
+ * Group the subtrees into the nodes of @shift. The levels which would have
+ * a single child are skipped by the compressed arrays, except the head.
+ * On failure, the subtrees which are left are packed at the front.
+ */
+static int xa_build_level(struct xa_build_part *part, unsigned int shift)
+{
+	struct xa_builder *b = part->b;
+	struct xa_node *node, **nodes = part->nodes;
+	unsigned long i = 0, j, out = 0, base;
+
+	while (i < part->nr) {
+		base = node_base(nodes[i]->index, shift);
+		for (j = i + 1; j < part->nr; j++) {
+			if (node_base(nodes[j]->index, shift) != base)
+				break;
+		}
+
+		if (j == i + 1 && xa_compressed(b->xa) && shift < b->top) {
+			nodes[out++] = nodes[i++];
+			continue;
+		}
+
+		node = xa_build_alloc(b, shift, base);
+		if (!node) {
+			memmove(&nodes[out], &nodes[i],
+				(part->nr - i) * sizeof(*nodes));
+			part->nr = out + part->nr - i;
+			return -ENOMEM;
+		}
+
+		for (; i < j; i++)
+			xa_build_link(part, node, nodes[i]);
+		nodes[out++] = node;
+	}
+
+	part->nr = out;
+	return 0;
 }
 
-void *xa_load(struct xarray *xa, unsigned long index)
+/* Build the leaves from the entries, and the levels below the split */
+static void *xa_build_part(void *arg)
 {
-	XA_STATE(xas, xa, index);
+	struct xa_build_part *part = arg;
+	struct xa_builder *b = part->b;
+	unsigned long i = part->first, last = part->first + part->nr;
+	unsigned long out = 0;
+	struct xa_node *node;
+	unsigned int shift;
 	void *entry;
 
-	xa_lock(xa);
+	part->nr_entries = part->nr;
+	while (i < last) {
+		node = xa_build_alloc(b, 0, b->indexes[i]);
+		if (!node) {
+			part->nr = out;
+			part->err = -ENOMEM;
+			return NULL;
+		}
 
-	do {
-		entry = xas_load(&xas);
-		if (xa_is_zero(entry))
-			entry = NULL;
-	} while (xas_retry(&xas, entry));
+		do {
+			entry = b->entries[i];
+			node->slots[b->indexes[i] & XA_CHUNK_MASK] = entry;
+			node->count++;
+			node->nr_values += xa_is_value(entry);
+		} while (++i < last && !xa_build_leaf(b->indexes, i));
+
+		node->total = node->count;
+		part->nodes[out++] = node;
+	}
 
-	xa_unlock(xa);
+	part->nr = out;
+	shift = XA_CHUNK_SHIFT;
+	for (; !part->err && shift < b->shift; shift += XA_CHUNK_SHIFT)
+		part->err = xa_build_level(part, shift);
 
-	return entry;
+	return NULL;
 }
 
-void *xa_store(struct xarray *xa, unsigned long index, void *entry)
+/*
+ * The entries have to be sorted by the strictly increasing indexes, and
+ * be neither NULL nor internal. Returns the number of leaves.
+ */
+static long xa_build_check(const unsigned long *indexes,
+			   void * const *entries, unsigned long nr)
 {
-	XA_STATE(xas, xa, index);
-	void *curr;
-
-	if (xa_is_advanced(entry))
-		return XA_ERROR(-EINVAL);
+	unsigned long i;
+	long leaves = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!entries[i] || xa_is_internal(entries[i]))
+			return -EINVAL;
+		if (i && indexes[i] <= indexes[i - 1])
+			return -EINVAL;
+		if (xa_build_leaf(indexes, i))
+			leaves++;
+	}
 
-	if (xa_track_free(xa) && !entry)
-		entry = XA_ZERO_ENTRY;
+	return leaves;
+}
 
-	xa_lock(xa);
+/* Split the entries at the boundaries of the subtrees of @b->shift */
+static void xa_build_split(struct xa_builder *b, struct xa_build_part *parts,
+			   unsigned int nr_parts, unsigned long nr)
+{
+	unsigned long i, first, leaves = 0;
+	unsigned int k;
+
+	for (k = 0; k < nr_parts; k++) {
+		first = nr * k / nr_parts;
+		if (k && first < parts[k - 1].first)
+			first = parts[k - 1].first;
+		while (first && first < nr &&
+		       !((b->indexes[first] ^ b->indexes[first - 1]) >>
+			 b->shift))
+			first++;
+
+		parts[k].b = b;
+		parts[k].first = first;
+		if (k)
+			parts[k - 1].nr = first - parts[k - 1].first;
+	}
+	parts[nr_parts - 1].nr = nr - parts[nr_parts - 1].first;
 
-	do {
-		curr = xas_store(&xas, entry);
-		if (xa_track_free(xa))
-			xas_clear_mark(&xas, XA_FREE_MARK);
-	} while (xas_nomem(&xas));
+	/* The subtrees of every part are built over its leaves */
+	for (i = 0, k = 0; k < nr_parts; k++) {
+		for (; i < parts[k].first; i++)
+			leaves += xa_build_leaf(b->indexes, i);
+		parts[k].nodes = &b->nodes[leaves];
+	}
+}
 
-	xa_unlock(xa);
+static int xa_build_parts(struct xa_builder *b, struct xa_build_part *parts,
+			  unsigned int nr_parts, struct xa_build_part *top)
+{
+	unsigned int k;
+	int ret = 0;
+
+	for (k = 1; k < nr_parts; k++) {
+		parts[k].threaded = !pthread_create(&parts[k].thread, NULL,
+						    xa_build_part, &parts[k]);
+		if (!parts[k].threaded)
+			xa_build_part(&parts[k]);
+	}
+	xa_build_part(&parts[0]);
+
+	/* The subtrees of the parts are packed for the levels above */
+	top->b = b;
+	top->nodes = b->nodes;
+	top->nr = 0;
+	top->nr_entries = 0;
+	for (k = 0; k < nr_parts; k++) {
+		if (parts[k].threaded)
+			pthread_join(parts[k].thread, NULL);
+		if (parts[k].err)
+			ret = parts[k].err;
+
+		memmove(&b->nodes[top->nr], parts[k].nodes,
+			parts[k].nr * sizeof(*b->nodes));
+		top->nr += parts[k].nr;
+		top->nr_entries += parts[k].nr_entries;
+	}
 
-	return xas_result(&xas, curr);
+	return ret;
 }
 
-void *xa_store_range(struct xarray *xa, unsigned long first,
-		     unsigned long last, void *entry)
+static int xa_build_tree(struct xarray *xa, const unsigned long *indexes,
+			 void * const *entries, unsigned long nr,
+			 unsigned long leaves, unsigned int threads)
 {
-	XA_STATE(xas, xa, 0);
-	unsigned int order;
+	struct xa_builder b = {
+		.xa		= xa,
+		.indexes	= indexes,
+		.entries	= entries,
+	};
+	struct xa_build_part *parts, top;
+	unsigned long max = indexes[nr - 1], span = max - indexes[0];
+	unsigned int nr_parts, k;
+	int ret;
+
+	if (!max) {
+		xa->xa_head = entries[0];
+		xa_account_entries(xa, 1);
+		return 0;
+	}
 
-	if (xa_is_internal(entry))
-		return XA_ERROR(-EINVAL);
-	if (last < first)
-		return XA_ERROR(-EINVAL);
+	while ((max >> b.top) >= XA_CHUNK_SIZE)
+		b.top += XA_CHUNK_SHIFT;
+
+	nr_parts = threads;
+	if (nr / XA_BUILD_BATCH < nr_parts)
+		nr_parts = nr / XA_BUILD_BATCH ? : 1;
+	b.shift = b.top;
+	while (nr_parts > 1 && b.shift > XA_CHUNK_SHIFT &&
+	       (span >> b.shift) < XA_CHUNK_SIZE * nr_parts)
+		b.shift -= XA_CHUNK_SHIFT;
+	if (!b.shift)
+		b.shift = XA_CHUNK_SHIFT;
+
+	b.nodes = malloc(leaves * sizeof(*b.nodes));
+	parts = calloc(nr_parts, sizeof(*parts));
+	if (!b.nodes || !parts) {
+		free(b.nodes);
+		free(parts);
+		return -ENOMEM;
+	}
 
-	do {
-		xa_lock(xa);
+	pthread_mutex_init(&b.lock, NULL);
+	xa_build_split(&b, parts, nr_parts, nr);
+	ret = xa_build_parts(&b, parts, nr_parts, &top);
+	for (k = b.shift; !ret && k <= b.top; k += XA_CHUNK_SHIFT)
+		ret = xa_build_level(&top, k);
 
-		if (entry) {
-			order = BITS_PER_LONG;
-			if (last + 1)
-				order = __ffs(last + 1);
-			xas_set_order(&xas, last, order);
-			xas_create(&xas, true);
-			if (xas_error(&xas))
-				goto unlock;
-		}
+	if (ret) {
+		for (k = 0; k < top.nr; k++)
+			xa_build_free(&b, b.nodes[k]);
+	} else {
+		xa->xa_head = xa_mk_node(b.nodes[0]);
+		xa_account_node(xa, b.nr_nodes);
+		xa_account_entries(xa, top.nr_entries);
+	}
 
-		do {
-			xas_set_range(&xas, first, last);
-			xas_store(&xas, entry);
-			if (xas_error(&xas))
-				goto unlock;
-			first += xas_size(&xas);
-		} while (first <= last);
-unlock:
-		xa_unlock(xa);
-	} while (xas_nomem(&xas));
+	pthread_mutex_destroy(&b.lock);
+	free(parts);
+	free(b.nodes);
+	return ret;
+}
 
-	return xas_result(&xas, NULL);
+/*
+ * The arrays whose entries aren't kept in the nodes are built by stores,
+ * which hold the lock on behalf of xa_build_sorted().
+ */
+static int xa_build_stores(struct xarray *xa, const unsigned long *indexes,
+			   void * const *entries, unsigned long nr,
+			   const char *func)
+{
+	unsigned long i;
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = xa_err(__xa_store(xa, indexes[i], entries[i], func));
+		if (ret) {
+			while (i--)
+				__xa_erase(xa, indexes[i], func);
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
-void *xa_find(struct xarray *xa, unsigned long *indexp,
-	      unsigned long max, xa_mark_t filter)
+/*
+ * Build an empty array from @nr entries sorted by their indexes. The nodes
+ * are assembled directly, and the subtrees are built by up to @threads
+ * threads. The allocating and adaptive arrays, and the inline arrays with
+ * no more entries than the inline slots, are built by stores.
+ */
+int xa_build_sorted(struct xarray *xa, const unsigned long *indexes,
+		    void * const *entries, unsigned long nr,
+		    unsigned int threads)
 {
-	XA_STATE(xas, xa, *indexp);
-	void *entry;
+	long leaves;
+	int ret;
+
+	leaves = xa_build_check(indexes, entries, nr);
+	if (leaves <= 0)
+		return leaves;
 
 	xa_lock(xa);
+	if (xa_head(xa) || (xa_inlined(xa) && xa->xa_nr_inline)) {
+		xa_unlock(xa);
+		return -EBUSY;
+	}
 
-        do {
-		if ((__force unsigned int)filter < XA_MAX_MARKS)
-			entry = xas_find_marked(&xas, max, filter);
-		else
-			entry = xas_find(&xas, max);
-	} while (xas_retry(&xas, entry));
+	if (xa_track_free(xa) || xa_adaptive(xa) || xa_packed(xa) ||
+	    (xa_inlined(xa) && nr <= XA_INLINE_SLOTS)) {
+		xa_unlock(xa);
+		return xa_build_stores(xa, indexes, entries, nr, __func__);
+	}
 
-	xa_unlock(xa);
+	if (unlikely(xa->xa_recorder)) {
+		unsigned long i;
 
-	if (entry)
-		*indexp = xas.xa_index;
-	return entry;
+		for (i = 0; i < nr; i++)
+			xa_record(xa, XA_OP_STORE, indexes[i], indexes[i],
+				  entries[i], 0);
+	}
+
+	ret = xa_build_tree(xa, indexes, entries, nr, leaves, threads ? : 1);
+	if (!ret && xa_inlined(xa))
+		xa->xa_nr_inline = XA_INLINE_TREE;
+
+	xa_unlock(xa);
+	return ret;
 }
 
-void *xa_find_after(struct xarray *xa, unsigned long *indexp,
-		    unsigned long max, xa_mark_t filter)
+/******************* XArray compaction */
+
+/*
+ * The nodes are relocated to the node regions in DFS order, which are
+ * carved contiguously. Every call of xa_compact() relocates one unit,
+ * the subtree whose root has XA_COMPACT_SHIFT, so the lock is held for
+ * at most 273 nodes. The first call of a pass shrinks the tree and
+ * relocates the nodes above the units before the first unit.
+ */
+#define XA_COMPACT_SHIFT	(2 * XA_CHUNK_SHIFT)
+#define XA_COMPACT_SPAN		(XA_CHUNK_SIZE << XA_COMPACT_SHIFT)
+
+/* Relocate @node and its descendants whose shift isn't below @shift */
+static int xa_compact_node(struct xarray *xa, struct xa_node *node,
+			   unsigned int shift)
 {
-	XA_STATE(xas, xa, *indexp + 1);
+	struct xa_node *child, *new = xa_region_carve(xa);
+	unsigned int i;
 	void *entry;
+	int ret;
 
-	if (xas.xa_index == 0)
-		return NULL;
+	if (!new)
+		return -ENOMEM;
 
-	xa_lock(xa);
+	memcpy(new, node, sizeof(*new));
+	new->pooled = 1;
 
-	for (;;) {
-		if ((__force unsigned int)filter < XA_MAX_MARKS)
-			entry = xas_find_marked(&xas, max, filter);
-		else
-			entry = xas_find(&xas, max);
+	if (node->parent)
+		node->parent->slots[node->offset] = xa_mk_node(new);
+	else
+		xa->xa_head = xa_mk_node(new);
 
-		if (xas_invalid(&xas))
-			break;
-		if (xas_is_sibling(&xas))
+	for (i = 0; new->shift && i < XA_CHUNK_SIZE; i++) {
+		entry = new->slots[i];
+		if (xa_is_node(entry))
+			xa_to_node(entry)->parent = new;
+	}
+
+	if (xa_hinted(xa))
+		xa_seq_bump(xa);
+	xa_node_release(xa, node);
+
+	for (i = 0; new->shift && i < XA_CHUNK_SIZE; i++) {
+		entry = new->slots[i];
+		if (!xa_is_node(entry))
 			continue;
-		if (!xas_retry(&xas, entry))
-			break;
+
+		child = xa_to_node(entry);
+		if (child->shift < shift)
+			continue;
+
+		ret = xa_compact_node(xa, child, shift);
+		if (ret)
+			return ret;
 	}
 
-	xa_unlock(xa);
+	return 0;
+}
 
-	if (entry)
-		*indexp = xas.xa_index;
-	return entry;
+/* The unit covering the index, or the whole tree if it's lower */
+static struct xa_node *xa_compact_unit(struct xarray *xa, unsigned long index)
+{
+	void *entry = xa_head(xa);
+	struct xa_node *node;
+
+	while (xa_is_node(entry)) {
+		node = xa_to_node(entry);
+		if (node->shift <= XA_COMPACT_SHIFT)
+			return node;
+
+		entry = xa_entry(xa, node, get_offset(node, index));
+	}
+
+	return NULL;
 }
 
-int xa_get_order(struct xarray *xa, unsigned long index)
+/*
+ * Relocate the unit covering *@indexp, which is zero to start a pass.
+ * *@indexp is advanced to the next unit with entries. It returns 1 when
+ * there are more units to be relocated, 0 when the pass completes, or
+ * a negative error code.
+ */
+int xa_compact(struct xarray *xa, unsigned long *indexp)
 {
-	XA_STATE(xas, xa, index);
-	void *entry;
-	int order = 0;
-	unsigned int slot;
+	XA_STATE(xas, xa, 0);
+	struct xa_node *node;
+	unsigned long index = ALIGN_DOWN(*indexp, XA_COMPACT_SPAN);
+	int ret = 0;
 
 	xa_lock(xa);
 
-	entry = xas_load(&xas);
-	if (!entry)
+	/* No node to be relocated */
+	if (xa_inlined(xa) || xa_adaptive(xa))
 		goto unlock;
 
-	if (!xas.xa_node)
-		goto unlock;
+	if (!index && xa_is_node(xa_head(xa))) {
+		xas.xa_node = xa_to_node(xa_head(xa));
+		xas_shrink(&xas);
 
-	for (;;) {
-		slot = xas.xa_offset + (1 << order);
+		node = xa_is_node(xa_head(xa)) ? xa_to_node(xa_head(xa)) : NULL;
+		if (node && node->shift > XA_COMPACT_SHIFT)
+			ret = xa_compact_node(xa, node, XA_COMPACT_SHIFT + 1);
+	}
 
-		if (slot >= XA_CHUNK_SIZE)
-			break;
-		if (!xa_is_sibling(xas.xa_node->slots[slot]))
-			break;
-		order++;
+	node = xa_compact_unit(xa, index);
+	if (!ret && node)
+		ret = xa_compact_node(xa, node, 0);
+
+	if (!ret && index + XA_COMPACT_SPAN > index) {
+		xas_set(&xas, index + XA_COMPACT_SPAN);
+		if (xas_find(&xas, ULONG_MAX)) {
+			*indexp = ALIGN_DOWN(xas.xa_index, XA_COMPACT_SPAN);
+			ret = 1;
+		}
 	}
 
-	order += xas.xa_node->shift;
 unlock:
 	xa_unlock(xa);
 
-	return order;
+	if (ret <= 0)
+		*indexp = 0;
+	return ret;
 }
 
-void *xa_erase(struct xarray *xa, unsigned long index)
+/******************* IDA */
+
+void ida_init(struct ida *ida)
 {
-	XA_STATE(xas, xa, index);
-	void *entry;
+	xa_init_flags(&ida->xa, XA_FLAGS_ALLOC);
+}
 
-	sem_wait(&xa->sem);
+/*
+ * Allocate the lowest free ID in [@min, @max]. The bitmap is allocated
+ * with the lock released when the bits can't be kept in the value entry,
+ * and the search is restarted. It returns the ID, -ENOSPC when there is
+ * no free ID in the range, or -ENOMEM.
+ */
+int ida_alloc_range(struct ida *ida, unsigned int min, unsigned int max)
+{
+	XA_STATE(xas, &ida->xa, min / IDA_BITMAP_BITS);
+	unsigned int bit = min % IDA_BITMAP_BITS;
+	struct ida_bitmap *bitmap, *alloc = NULL;
+	unsigned long tmp;
+
+	if ((int)min < 0)
+		return -ENOSPC;
+	if ((int)max < 0)
+		max = INT_MAX;
+
+retry:
+	xa_lock(&ida->xa);
+next:
+	bitmap = xas_find_marked(&xas, max / IDA_BITMAP_BITS, XA_FREE_MARK);
+	if (xas.xa_index > min / IDA_BITMAP_BITS)
+		bit = 0;
+	if (xas.xa_index * IDA_BITMAP_BITS + bit > max)
+		goto nospc;
+
+	if (xa_is_value(bitmap)) {
+		tmp = xa_to_value(bitmap);
+
+		if (bit < BITS_PER_XA_VALUE) {
+			bit = find_next_zero_bit(&tmp, BITS_PER_XA_VALUE, bit);
+			if (xas.xa_index * IDA_BITMAP_BITS + bit > max)
+				goto nospc;
+			if (bit < BITS_PER_XA_VALUE) {
+				tmp |= 1UL << bit;
+				xas_store(&xas, xa_mk_value(tmp));
+				goto out;
+			}
+		}
 
-	entry = xas_result(&xas, xas_store(&xas, NULL));
+		/* The bits are moved to the bitmap */
+		bitmap = alloc;
+		if (!bitmap)
+			goto alloc;
 
-	sem_post(&xa->sem);
+		bitmap->bitmap[0] = tmp;
+		xas_store(&xas, bitmap);
+		if (xas_error(&xas)) {
+			bitmap->bitmap[0] = 0;
+			goto out;
+		}
+	}
 
-	return entry;
+	if (bitmap) {
+		bit = find_next_zero_bit(bitmap->bitmap, IDA_BITMAP_BITS, bit);
+		if (xas.xa_index * IDA_BITMAP_BITS + bit > max)
+			goto nospc;
+		if (bit == IDA_BITMAP_BITS)
+			goto next;
+
+		__set_bit(bit, bitmap->bitmap);
+		if (bitmap_full(bitmap->bitmap, IDA_BITMAP_BITS))
+			xas_clear_mark(&xas, XA_FREE_MARK);
+	} else {
+		if (bit < BITS_PER_XA_VALUE) {
+			bitmap = xa_mk_value(1UL << bit);
+		} else {
+			bitmap = alloc;
+			if (!bitmap)
+				goto alloc;
+
+			__set_bit(bit, bitmap->bitmap);
+		}
+
+		xas_store(&xas, bitmap);
+	}
+
+out:
+	xa_unlock(&ida->xa);
+	if (xas_nomem(&xas)) {
+		xas_set(&xas, min / IDA_BITMAP_BITS);
+		bit = min % IDA_BITMAP_BITS;
+		goto retry;
+	}
+
+	if (bitmap != alloc)
+		free(alloc);
+	if (xas_error(&xas))
+		return xas_error(&xas);
+
+	return xas.xa_index * IDA_BITMAP_BITS + bit;
+
+alloc:
+	xa_unlock(&ida->xa);
+	alloc = calloc(1, sizeof(*alloc));
+	if (!alloc)
+		return -ENOMEM;
+
+	xas_set(&xas, min / IDA_BITMAP_BITS);
+	bit = min % IDA_BITMAP_BITS;
+	goto retry;
+
+nospc:
+	xa_unlock(&ida->xa);
+	free(alloc);
+	return -ENOSPC;
 }
 
-bool xa_get_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+/* Freeing an ID which isn't allocated does nothing */
+void ida_free(struct ida *ida, unsigned int id)
 {
-	XA_STATE(xas, xa, index);
-	void *entry;
+	XA_STATE(xas, &ida->xa, id / IDA_BITMAP_BITS);
+	unsigned int bit = id % IDA_BITMAP_BITS;
+	struct ida_bitmap *bitmap;
+	unsigned long v;
 
-	xa_lock(xa);
+	if ((int)id < 0)
+		return;
 
-	entry = xas_start(&xas);
-	while (xas_get_mark(&xas, mark)) {
-		if (!xa_is_node(entry)) {
-			xa_unlock(xa);
-			return true;
-		}
+	xa_lock(&ida->xa);
+	bitmap = xas_load(&xas);
 
-		entry = xas_descend(&xas, xa_to_node(entry));
-	}
+	if (xa_is_value(bitmap)) {
+		v = xa_to_value(bitmap);
+		if (bit >= BITS_PER_XA_VALUE || !(v & (1UL << bit)))
+			goto out;
 
-	xa_unlock(xa);
+		v &= ~(1UL << bit);
+		if (!v)
+			goto delete;
 
-        return false;
+		xas_store(&xas, xa_mk_value(v));
+	} else {
+		if (!bitmap || !test_bit(bit, bitmap->bitmap))
+			goto out;
+
+		__clear_bit(bit, bitmap->bitmap);
+		xas_set_mark(&xas, XA_FREE_MARK);
+		if (bitmap_empty(bitmap->bitmap, IDA_BITMAP_BITS)) {
+			free(bitmap);
+delete:
+			xas_store(&xas, NULL);
+		}
+	}
+
+out:
+	xa_unlock(&ida->xa);
 }
 
-void xa_set_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+bool ida_exists(struct ida *ida, unsigned int id)
 {
-	XA_STATE(xas, xa, index);
-	void *entry;
+	XA_STATE(xas, &ida->xa, id / IDA_BITMAP_BITS);
+	unsigned int bit = id % IDA_BITMAP_BITS;
+	struct ida_bitmap *bitmap;
+	bool exists = false;
 
-        xa_lock(xa);
+	if ((int)id < 0)
+		return false;
 
-	entry = xas_load(&xas);
-	if (entry)
-		xas_set_mark(&xas, mark);
+	xa_lock(&ida->xa);
 
-	xa_unlock(xa);
+	bitmap = xas_load(&xas);
+	if (xa_is_value(bitmap))
+		exists = bit < BITS_PER_XA_VALUE &&
+			 (xa_to_value(bitmap) & (1UL << bit));
+	else if (bitmap)
+		exists = test_bit(bit, bitmap->bitmap);
+
+	xa_unlock(&ida->xa);
+
+	return exists;
 }
 
-void xa_clear_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+/* Free all IDs, but the IDA can be reused */
+void ida_destroy(struct ida *ida)
 {
-	XA_STATE(xas, xa, index);
-	void *entry;
+	XA_STATE(xas, &ida->xa, 0);
+	struct ida_bitmap *bitmap;
 
-	xa_lock(xa);
+	xa_lock(&ida->xa);
 
-	entry = xas_load(&xas);
-	if (entry)
-		xas_clear_mark(&xas, mark);
+	while ((bitmap = xas_find(&xas, ULONG_MAX))) {
+		if (!xa_is_value(bitmap))
+			free(bitmap);
+	}
 
-	xa_unlock(xa);
+	xa_unlock(&ida->xa);
+
+	__xa_destroy(&ida->xa, __func__);
 }
@@ -5,14 +5,10 @@
 
 int main(int argc, char **argv)
 {
-	atomic_t a;
+	bool ret = true;
 
-	a.counter = 1;
-	arch_atomic_add(&a, 1);
-	fprintf(stdout, "%d\n", a.counter);
+	ret &= test_lib_xarray();
+	ret &= test_lib_trace();
 
-	//test_lib_xarray();
-
-	return 0;
+	return ret ? 0 : 1;
 }
-
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Event tracing
+ */
+
+#define _GNU_SOURCE
+#include <mbox/base.h>
+#include <mbox/test.h>
+#include <mbox/timestamp.h>
+#include <mbox/trace.h>
+
+/*
+ * The merged records are written to @fp. When @overwrite is set, the
+ * first write appends that many records to @ring, overwriting the oldest
+ * ones before they're merged, and leaves one more half written.
+ */
+struct trace_sink {
+	FILE			*fp;
+	struct trace_ring	*ring;
+	unsigned int		overwrite;
+};
+
+static struct trace_ring *trace_ring_new(u32 tid)
+{
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+
+	if (ring) {
+		ring->magic = TRACE_RING_MAGIC;
+		ring->tid = tid;
+		ring->freq = NSEC_PER_SEC;
+	}
+
+	return ring;
+}
+
+static void trace_ring_write(struct trace_ring *ring, u64 ts, bool publish)
+{
+	struct trace_record *rec;
+
+	rec = &ring->records[ring->head & (TRACE_RING_RECORDS - 1)];
+	rec->ts = ts;
+	rec->id = TRACE_XAS_STORE;
+	rec->tid = ring->tid;
+	rec->args[0] = ts;
+	if (publish)
+		__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static ssize_t trace_sink_write(void *cookie, const char *buf, size_t size)
+{
+	struct trace_sink *sink = cookie;
+	u64 ts = sink->ring ? sink->ring->head : 0;
+
+	if (sink->overwrite) {
+		for (; sink->overwrite; sink->overwrite--)
+			trace_ring_write(sink->ring, ts++, true);
+		trace_ring_write(sink->ring, ts, false);
+	}
+
+	return fwrite(buf, 1, size, sink->fp);
+}
+
+/*
+ * Merge the rings through the sink, and check that the records come out
+ * in the order of their timestamps. The number of the merged and the
+ * lost records are returned.
+ */
+static bool trace_merge_check(struct trace_ring **rings, int nr,
+			      struct trace_sink *sink,
+			      unsigned long *merged, unsigned long *lost)
+{
+	cookie_io_functions_t io = { .write = trace_sink_write };
+	unsigned long long ts, prev = 0, n;
+	char line[256];
+	FILE *fp;
+	bool ret = false;
+
+	*merged = *lost = 0;
+	sink->fp = tmpfile();
+	fp = sink->fp ? fopencookie(sink, "w", io) : NULL;
+	if (!fp)
+		goto out;
+
+	/* Every record reaches the sink on its own */
+	setvbuf(fp, NULL, _IONBF, 0);
+	if (trace_merge(rings, nr, fp))
+		goto out;
+
+	rewind(sink->fp);
+	while (fgets(line, sizeof(line), sink->fp)) {
+		if (sscanf(line, "# %llu records lost", &n) == 1) {
+			*lost = n;
+			continue;
+		}
+
+		if (sscanf(line, "%llu", &ts) != 1 || ts < prev)
+			goto out;
+		prev = ts;
+		(*merged)++;
+	}
+
+	ret = true;
+out:
+	if (fp)
+		fclose(fp);
+	if (sink->fp)
+		fclose(sink->fp);
+	return ret;
+}
+
+/*
+ * The oldest records of a wrapped ring are skipped, including the one in
+ * the slot to be written next, and none is lost.
+ */
+static bool test_merge_wrap(void)
+{
+	struct trace_ring *rings[2] = { trace_ring_new(1), trace_ring_new(2) };
+	struct trace_sink sink = { };
+	unsigned long i, merged, lost;
+	bool ret = false;
+
+	if (!rings[0] || !rings[1])
+		goto out;
+
+	for (i = 0; i < TRACE_RING_RECORDS + 100; i++)
+		trace_ring_write(rings[0], 2 * i, true);
+	for (i = 0; i < 50; i++)
+		trace_ring_write(rings[1], 2 * i + 1, true);
+
+	if (!trace_merge_check(rings, 2, &sink, &merged, &lost) ||
+	    merged != TRACE_RING_RECORDS - 1 + 50 || lost)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "trace wrap:       %s\n", ret ? "passed" : "failed");
+	free(rings[0]);
+	free(rings[1]);
+	return ret;
+}
+
+/*
+ * The records which are overwritten after the merge starts are counted
+ * as lost, including the one being written in the slot the head reached,
+ * instead of being reported out of order. The first record is printed
+ * before the overwrite, and the next 9 are lost.
+ */
+static bool test_merge_overwrite(void)
+{
+	struct trace_ring *ring = trace_ring_new(1);
+	struct trace_sink sink = { .ring = ring, .overwrite = 10 };
+	unsigned long i, merged, lost;
+	bool ret = false;
+
+	if (!ring)
+		goto out;
+
+	for (i = 0; i < TRACE_RING_RECORDS; i++)
+		trace_ring_write(ring, i, true);
+
+	if (!trace_merge_check(&ring, 1, &sink, &merged, &lost) ||
+	    lost != 9 || merged != TRACE_RING_RECORDS - 10)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "trace overwrite:  %s\n", ret ? "passed" : "failed");
+	free(ring);
+	return ret;
+}
+
+bool test_lib_trace(void)
+{
+	bool ret = true;
+
+	ret &= test_merge_wrap();
+	ret &= test_merge_overwrite();
+
+	return ret;
+}
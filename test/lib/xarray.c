@@ -3,7 +3,9 @@
  * eXtensible Array
  */
 
+#include <pthread.h>
 #include <mbox/base.h>
+#include <mbox/test.h>
 #include <mbox/xarray.h>
 
 static void dump_one_node(struct xa_node *node, int level)
@@ -35,7 +37,7 @@ static void dump_subordinate_nodes(struct xa_node *node, int level)
 
 	dump_one_node(node, level);
 
-	for (offset = 0; offset <= XA_CHUNK_SIZE; offset++) {
+	for (offset = 0; offset < XA_CHUNK_SIZE; offset++) {
 		if (!xa_is_node(node->slots[offset]))
 			continue;
 
@@ -109,8 +111,1007 @@ static void split_and_add_entry(struct xarray *xa, unsigned long index,
 	} while (xas_nomem(&xas));	
 }
 
-void test_lib_xarray(void)
+static bool test_checkpoint(void)
+{
+	struct xarray src, dst, replica;
+	unsigned long index;
+	FILE *fp = tmpfile();
+	bool ret = false;
+	long pos;
+
+	xa_init(&src);
+	xa_init(&dst);
+	xa_init(&replica);
+	if (!fp)
+		goto out;
+
+	for (index = 0; index < 1024; index += 3)
+		xa_store(&src, index, xa_mk_value(index));
+	if (xa_checkpoint(&src, fp))
+		goto out;
+
+	/* The replica follows the source by the incremental checkpoints */
+	pos = ftell(fp);
+	rewind(fp);
+	if (xa_restore(&replica, fp))
+		goto out;
+
+	fseek(fp, pos, SEEK_SET);
+	xa_erase(&src, 999);
+	xa_store(&src, 4096, xa_mk_value(4096));
+	if (xa_checkpoint_incremental(&src, fp))
+		goto out;
+
+	rewind(fp);
+	if (xa_restore(&dst, fp) || xa_restore(&dst, fp))
+		goto out;
+
+	fseek(fp, pos, SEEK_SET);
+	if (xa_restore(&replica, fp))
+		goto out;
+
+	pos = ftell(fp);
+	xa_store(&src, 5, xa_mk_value(5));
+	xa_erase(&src, 6);
+	if (xa_checkpoint_incremental(&src, fp))
+		goto out;
+
+	fseek(fp, pos, SEEK_SET);
+	if (xa_restore(&replica, fp))
+		goto out;
+
+	for (index = 0; index <= 4096; index++) {
+		if (xa_load(&src, index) != xa_load(&replica, index))
+			goto out;
+		if (index != 5 && index != 6 &&
+		    xa_load(&src, index) != xa_load(&dst, index))
+			goto out;
+	}
+
+	ret = true;
+out:
+	fprintf(stdout, "checkpoint:       %s\n", ret ? "passed" : "failed");
+	if (fp)
+		fclose(fp);
+	xa_destroy(&src);
+	xa_destroy(&dst);
+	xa_destroy(&replica);
+	return ret;
+}
+
+/* The coalesced ranges are restored only to a coalescing array */
+static bool test_checkpoint_coalesce(void)
+{
+	struct xarray src, plain, dst;
+	unsigned long index;
+	FILE *fp = tmpfile();
+	bool ret = false;
+	long pos;
+
+	xa_init_flags(&src, XA_FLAGS_COALESCE);
+	xa_init(&plain);
+	xa_init_flags(&dst, XA_FLAGS_COALESCE);
+	if (!fp)
+		goto out;
+
+	for (index = 0; index < 16; index++)
+		xa_store(&src, index, xa_mk_value(1));
+	xa_store(&src, 100, xa_mk_value(2));
+	if (xa_checkpoint(&src, fp))
+		goto out;
+
+	pos = ftell(fp);
+	rewind(fp);
+	if (xa_restore(&plain, fp) != -EINVAL || xa_load(&plain, 0))
+		goto out;
+
+	rewind(fp);
+	if (xa_restore(&dst, fp))
+		goto out;
+
+	fseek(fp, pos, SEEK_SET);
+	xa_store(&src, 5, xa_mk_value(3));
+	if (xa_checkpoint_incremental(&src, fp))
+		goto out;
+
+	fseek(fp, pos, SEEK_SET);
+	if (xa_restore(&dst, fp))
+		goto out;
+
+	for (index = 0; index <= 100; index++) {
+		if (xa_load(&src, index) != xa_load(&dst, index))
+			goto out;
+	}
+
+	ret = true;
+out:
+	fprintf(stdout, "checkpoint merge: %s\n", ret ? "passed" : "failed");
+	if (fp)
+		fclose(fp);
+	xa_destroy(&src);
+	xa_destroy(&plain);
+	xa_destroy(&dst);
+	return ret;
+}
+
+/* The count and the rank of a coalescing array are taken per index */
+static bool test_count_coalesce(void)
+{
+	struct xarray xa;
+	unsigned long index, nr = 0;
+	bool ret = false;
+
+	xa_init_flags(&xa, XA_FLAGS_COALESCE);
+	for (index = 0; index < 16; index++)
+		xa_store(&xa, index, xa_mk_value(1));
+	xa_store(&xa, 100, xa_mk_value(2));
+	for (index = 512; index < 768; index++)
+		xa_store(&xa, index, xa_mk_value(3));
+
+	for (index = 0; index < 1024; index++) {
+		if (xa_rank(&xa, index) != nr)
+			goto out;
+		nr += xa_load(&xa, index) != NULL;
+	}
+
+	if (xa_count_range(&xa, 0, ~0UL) != nr ||
+	    xa_count_range(&xa, 4, 7) != 4 ||
+	    xa_count_range(&xa, 10, 100) != 7 ||
+	    xa_count_range(&xa, 600, 1000) != 168)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "count coalesce:   %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+/* The modes count the indexes, each index of a range store counting */
+static bool test_count_modes(void)
+{
+	static const unsigned long flags[] = {
+		0, XA_FLAGS_COUNT, XA_FLAGS_COALESCE, XA_FLAGS_COMPRESS,
+		XA_FLAGS_COUNT | XA_FLAGS_COMPRESS,
+	};
+	const unsigned long wide = 1UL << 36;	/* Above @total of a node */
+	struct xarray xa;
+	unsigned long i;
+	bool ret = true;
+
+	for (i = 0; ret && i < sizeof(flags) / sizeof(flags[0]); i++) {
+		xa_init_flags(&xa, flags[i]);
+		xa_store_range(&xa, 0, 255, xa_mk_value(1));
+		xa_store(&xa, 1000, xa_mk_value(2));
+		xa_store_range(&xa, wide, 2 * wide - 1, xa_mk_value(3));
+
+		ret = xa_count_range(&xa, 0, ~0UL) == wide + 257 &&
+		      xa_count_range(&xa, 4, 7) == 4 &&
+		      xa_count_range(&xa, 200, 1000) == 57 &&
+		      xa_count_range(&xa, 1001, wide - 1) == 0 &&
+		      xa_count_range(&xa, wide + 16, ~0UL) == wide - 16 &&
+		      xa_rank(&xa, 1000) == 256 &&
+		      xa_rank(&xa, wide + 5) == 262;
+
+		/* Erasing a range store erases all of it */
+		xa_erase(&xa, 1000);
+		xa_erase(&xa, wide);
+		ret = ret && xa_count_range(&xa, 0, ~0UL) ==
+			     (xa_load(&xa, wide + 1) ? wide + 255 : 256);
+
+		if (!ret)
+			fprintf(stdout, "count flags 0x%lx\n", flags[i]);
+		xa_destroy(&xa);
+	}
+
+	fprintf(stdout, "count modes:      %s\n", ret ? "passed" : "failed");
+	return ret;
+}
+
+/* The node allocation beyond the budget fails, keeping the stored entries */
+static bool test_budget(void)
+{
+	struct xa_account account;
+	struct xarray xa;
+	unsigned long index;
+	bool ret = false;
+	void *curr = NULL;
+
+	xa_init_flags(&xa, XA_FLAGS_ACCOUNT);
+	xa_set_budget(&xa, 4 * sizeof(struct xa_node));
+
+	for (index = 0; index < 64; index++) {
+		curr = xa_store(&xa, index << 12, xa_mk_value(index));
+		if (xa_is_err(curr))
+			break;
+	}
+
+	xa_get_account(&xa, &account);
+	if (xa_err(curr) != -ENOMEM || !index ||
+	    account.node_bytes > account.budget ||
+	    account.nr_entries != index)
+		goto out;
+
+	while (index--) {
+		if (xa_load(&xa, index << 12) != xa_mk_value(index))
+			goto out;
+	}
+
+	xa_set_budget(&xa, 0);
+	if (xa_is_err(xa_store(&xa, 1UL << 40, xa_mk_value(1))))
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "budget:           %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+#define STATS_STORES		256
+#define STATS_LOADS		100
+#define STATS_ERASES		64
+
+static void *stats_load(void *arg)
+{
+	struct xarray *xa = arg;
+	unsigned long index;
+
+	for (index = 0; index < STATS_LOADS; index++)
+		xa_load(xa, index << 8);
+
+	return NULL;
+}
+
+static u64 stats_hist_sum(const struct xa_stats *stats, enum xa_stat_hist hist)
+{
+	u64 nr = 0;
+	int i;
+
+	for (i = 0; i < XA_STAT_BUCKETS; i++)
+		nr += stats->hist[hist][i];
+
+	return nr;
+}
+
+/*
+ * The counters of the calls made by two threads are summed up from
+ * their slots, and the calls before the statistics are enabled are not
+ * counted. The allocated nodes, less the freed ones, are the accounted
+ * nodes.
+ */
+static bool test_stats(void)
+{
+	struct xa_account account;
+	struct xa_stats stats;
+	struct xarray xa;
+	pthread_t thread;
+	unsigned long index;
+	bool ret = false;
+
+	xa_init_flags(&xa, XA_FLAGS_ACCOUNT);
+	xa_store(&xa, 1UL << 40, xa_mk_value(0));
+	xa_load(&xa, 1UL << 40);
+	xa_erase(&xa, 1UL << 40);
+
+	if (xa_stats_enable(&xa))
+		goto out;
+
+	for (index = 0; index < STATS_STORES; index++)
+		xa_store(&xa, index << 8, xa_mk_value(index));
+	if (pthread_create(&thread, NULL, stats_load, &xa))
+		goto out;
+	stats_load(&xa);
+	pthread_join(thread, NULL);
+	for (index = 0; index < STATS_ERASES; index++)
+		xa_erase(&xa, index << 8);
+
+	xa_stats_read(&xa, &stats);
+	xa_get_account(&xa, &account);
+	if (stats.items[XA_STAT_STORE] != STATS_STORES ||
+	    stats.items[XA_STAT_LOAD] != 2 * STATS_LOADS ||
+	    stats.items[XA_STAT_ERASE] != STATS_ERASES ||
+	    stats.items[XA_STAT_NOMEM] ||
+	    stats.items[XA_STAT_NODE_ALLOC] - stats.items[XA_STAT_NODE_FREE] !=
+	    account.nr_nodes ||
+	    stats_hist_sum(&stats, XA_HIST_STORE) != STATS_STORES ||
+	    stats_hist_sum(&stats, XA_HIST_LOAD) != 2 * STATS_LOADS)
+		goto out;
+
+	/* Nothing is counted once they're disabled */
+	xa_stats_disable(&xa);
+	xa_load(&xa, 0);
+	xa_stats_read(&xa, &stats);
+	if (stats.items[XA_STAT_LOAD])
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "stats:            %s\n", ret ? "passed" : "failed");
+	xa_stats_disable(&xa);
+	xa_destroy(&xa);
+	return ret;
+}
+
+struct lock_waiter {
+	struct xarray	*xa;
+	bool		started;
+};
+
+static void *lock_mark_range(void *arg)
+{
+	struct lock_waiter *waiter = arg;
+
+	__atomic_store_n(&waiter->started, true, __ATOMIC_RELEASE);
+	xa_set_mark_range(waiter->xa, 0, ~0UL, XA_MARK_0);
+	return NULL;
+}
+
+static const struct xa_lock_api *lock_api(const struct xa_lock_stats *stats,
+					  const char *name)
+{
+	int i;
+
+	for (i = 0; i < XA_LOCK_APIS && stats->apis[i].name; i++) {
+		if (!strcmp(stats->apis[i].name, name))
+			return &stats->apis[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * The lock is held by another thread for 2ms when xa_set_mark_range()
+ * tries it, so that the wait lands in the buckets of a millisecond or
+ * more. The hold time is accounted against the public APIs, even when
+ * they take the lock through the helpers they share.
+ */
+static bool test_lock_stats(void)
+{
+	static const char * const names[] = {
+		"xa_set_mark_range", "xa_checkpoint", "xa_rank",
+	};
+	struct lock_waiter waiter = { };
+	struct xa_lock_stats stats;
+	struct xarray xa;
+	pthread_t thread;
+	unsigned long i;
+	u64 waits = 0, slow = 0;
+	FILE *fp = tmpfile();
+	bool ret = false;
+
+	xa_init(&xa);
+	waiter.xa = &xa;
+	for (i = 0; i < 64; i++)
+		xa_store(&xa, i << 4, xa_mk_value(i));
+	if (!fp || xa_lock_stats_enable(&xa))
+		goto out;
+
+	sem_wait(&xa.sem);
+	if (pthread_create(&thread, NULL, lock_mark_range, &waiter)) {
+		sem_post(&xa.sem);
+		goto out;
+	}
+	while (!__atomic_load_n(&waiter.started, __ATOMIC_ACQUIRE))
+		;
+	usleep(2000);
+	sem_post(&xa.sem);
+	pthread_join(thread, NULL);
+
+	xa_checkpoint(&xa, fp);
+	xa_rank(&xa, 100);
+	xa_lock_stats_read(&xa, &stats);
+
+	for (i = 0; i < XA_LOCK_BUCKETS; i++) {
+		waits += stats.wait[i];
+		if (i > 20)
+			slow += stats.wait[i];
+	}
+	if (stats.contended != 1 || slow != 1 || waits != stats.acquired)
+		goto out;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		const struct xa_lock_api *api = lock_api(&stats, names[i]);
+
+		if (!api || api->count != 1)
+			goto out;
+	}
+	if (stats.apis[i].name)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "lock stats:       %s\n", ret ? "passed" : "failed");
+	if (fp)
+		fclose(fp);
+	xa_lock_stats_disable(&xa);
+	xa_destroy(&xa);
+	return ret;
+}
+
+/* The recorded calls rebuild the array when they are replayed */
+static bool test_record(void)
+{
+	struct xa_record_header header;
+	struct xa_record r;
+	struct xarray src, dst;
+	unsigned long index;
+	FILE *fp = tmpfile();
+	bool ret = false;
+
+	xa_init(&src);
+	xa_init(&dst);
+	if (!fp || xa_record_start(&src, fp))
+		goto out;
+
+	for (index = 0; index < 1024; index += 3)
+		xa_store(&src, index, xa_mk_value(index));
+	for (index = 0; index < 1024; index += 9)
+		xa_erase(&src, index);
+	xa_store_range(&src, 2048, 2063, xa_mk_value(2048));
+	xa_set_mark(&src, 3, XA_MARK_1);
+	xa_load(&src, 4);
+
+	if (xa_record_start(&src, fp) != -EBUSY || xa_record_stop(&src))
+		goto out;
+
+	rewind(fp);
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != XA_RECORD_MAGIC || header.size != sizeof(r))
+		goto out;
+
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		void *entry = (void *)(unsigned long)r.entry;
+
+		switch (r.op) {
+		case XA_OP_STORE:
+			xa_store(&dst, r.index, entry);
+			break;
+		case XA_OP_STORE_RANGE:
+			xa_store_range(&dst, r.index, r.last, entry);
+			break;
+		case XA_OP_ERASE:
+			xa_erase(&dst, r.index);
+			break;
+		case XA_OP_SET_MARK:
+			xa_set_mark(&dst, r.index, (__force xa_mark_t)r.mark);
+			break;
+		}
+	}
+
+	for (index = 0; index < 4096; index++) {
+		if (xa_load(&src, index) != xa_load(&dst, index))
+			goto out;
+	}
+	if (!xa_get_mark(&dst, 3, XA_MARK_1))
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "record:           %s\n", ret ? "passed" : "failed");
+	if (fp)
+		fclose(fp);
+	xa_destroy(&src);
+	xa_destroy(&dst);
+	return ret;
+}
+
+/* The hint isn't followed once its node is freed */
+static bool test_hint(void)
 {
+	struct xarray xa;
+	unsigned long index;
+	bool ret = false;
+
+	xa_init_flags(&xa, XA_FLAGS_HINT);
+	xa_store(&xa, 0, xa_mk_value(0));
+	for (index = 0x1000; index < 0x1010; index++)
+		xa_store(&xa, index, xa_mk_value(index));
+
+	if (xa_load(&xa, 0x1004) != xa_mk_value(0x1004))
+		goto out;
+
+	/* Free the hinted node and reuse it for another range */
+	for (index = 0x1000; index < 0x1010; index++)
+		xa_erase(&xa, index);
+	xa_store(&xa, 0x2004, xa_mk_value(0x2004));
+
+	if (xa_load(&xa, 0x1004) || xa_load(&xa, 0x2004) != xa_mk_value(0x2004))
+		goto out;
+
+	/* Shrinking to the head entry */
+	xa_erase(&xa, 0x2004);
+	if (xa_load(&xa, 0x2004) || xa_load(&xa, 0) != xa_mk_value(0))
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "hint:             %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+/* The compaction relocates the nodes, keeping the entries and the marks */
+static bool test_compact(void)
+{
+	struct xarray xa;
+	unsigned long index = 0;
+	bool ret = false;
+	int err;
+
+	xa_init_flags(&xa, XA_FLAGS_HUGE | XA_FLAGS_HINT);
+	for (index = 0; index < 100000; index += 7)
+		xa_store(&xa, index * 13, xa_mk_value(index));
+	for (index = 0; index < 100000; index += 21)
+		xa_erase(&xa, index * 13);
+	xa_set_mark(&xa, 7 * 13, XA_MARK_0);
+
+	/* Load through the hint, which the relocation has to invalidate */
+	xa_load(&xa, 7 * 13);
+
+	index = 0;
+	do {
+		err = xa_compact(&xa, &index);
+	} while (err > 0);
+	if (err)
+		goto out;
+
+	for (index = 0; index < 100000; index++) {
+		void *entry = (index % 7 || !(index % 21)) ? NULL :
+			      xa_mk_value(index);
+
+		if (xa_load(&xa, index * 13) != entry)
+			goto out;
+	}
+	if (!xa_get_mark(&xa, 7 * 13, XA_MARK_0))
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "compact:          %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+/* Every index spans a leaf of its own, so the nodes fill several regions */
+#define REGIONS_LEAVES		40000
+
+static void *regions_leaf(struct xarray *xa, unsigned long index)
+{
+	XA_STATE(xas, xa, index);
+
+	xas_load(&xas);
+	return xas.xa_node;
+}
+
+/*
+ * The freed nodes are reused from the free list of their region, and
+ * only one empty region is kept when every node is freed. The empty
+ * regions backed by hugetlb pages are always unmapped.
+ */
+static bool test_regions(void)
+{
+	struct xa_account account;
+	struct xarray xa;
+	unsigned long index, nr_regions;
+	bool ret = false;
+	void *leaf;
+
+	xa_init_flags(&xa, XA_FLAGS_HUGE | XA_FLAGS_ACCOUNT);
+	for (index = 0; index < REGIONS_LEAVES; index++) {
+		if (xa_is_err(xa_store(&xa, index << XA_CHUNK_SHIFT,
+				       xa_mk_value(index))))
+			goto out;
+	}
+
+	xa_get_account(&xa, &account);
+	nr_regions = account.nr_regions;
+	if (nr_regions < 3 || account.nr_entries != REGIONS_LEAVES)
+		goto out;
+
+	/* The leaf of the first full region is the next one handed out */
+	leaf = regions_leaf(&xa, 0);
+	xa_erase(&xa, 0);
+	xa_store(&xa, 0, xa_mk_value(0));
+	if (!leaf || regions_leaf(&xa, 0) != leaf)
+		goto out;
+
+	for (index = 0; index < REGIONS_LEAVES; index += 2)
+		xa_erase(&xa, index << XA_CHUNK_SHIFT);
+	for (index = 0; index < REGIONS_LEAVES; index += 2)
+		xa_store(&xa, index << XA_CHUNK_SHIFT, xa_mk_value(index));
+
+	xa_get_account(&xa, &account);
+	if (account.nr_regions != nr_regions)
+		goto out;
+
+	for (index = 0; index < REGIONS_LEAVES; index++)
+		xa_erase(&xa, index << XA_CHUNK_SHIFT);
+
+	xa_get_account(&xa, &account);
+	if (account.nr_regions > 1 || account.nr_nodes ||
+	    account.node_bytes || account.nr_entries)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "regions:          %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+/* The leaves take turns with the values of each width */
+static void *packed_entry(unsigned long index)
+{
+	static const unsigned int widths[] = { 0, 1, 2, 4, 8 };
+	unsigned int width = widths[(index >> XA_CHUNK_SHIFT) % 5];
+
+	if (index % 3 == 2)
+		return NULL;
+
+	return xa_mk_value(index & ((1UL << width) - 1));
+}
+
+/*
+ * The leaves of small values take less memory than the nodes, and are
+ * expanded when a value which doesn't fit is stored. The memory is back
+ * to zero once the entries are erased.
+ */
+static bool test_packed(void)
+{
+	struct xa_account packed, plain;
+	struct xarray xa, ref;
+	unsigned long index, nr;
+	bool ret = false;
+	void *entry;
+
+	xa_init_flags(&xa, XA_FLAGS_PACKED | XA_FLAGS_ACCOUNT);
+	xa_init_flags(&ref, XA_FLAGS_ACCOUNT);
+	for (index = 0; index < 4096; index++) {
+		xa_store(&xa, index, packed_entry(index));
+		xa_store(&ref, index, packed_entry(index));
+	}
+
+	xa_get_account(&xa, &packed);
+	xa_get_account(&ref, &plain);
+	if (packed.nr_entries != plain.nr_entries ||
+	    packed.node_bytes * 4 > plain.node_bytes ||
+	    xa_count_range(&xa, 100, 3999) != xa_count_range(&ref, 100, 3999))
+		goto out;
+
+	for (index = 0; index < 4096; index++) {
+		if (xa_load(&xa, index) != packed_entry(index))
+			goto out;
+	}
+
+	nr = 0;
+	index = 0;
+	for (entry = xa_find(&xa, &index, ~0UL, XA_PRESENT); entry;
+	     entry = xa_find_after(&xa, &index, ~0UL, XA_PRESENT)) {
+		if (index % 3 == 2 || entry != packed_entry(index))
+			goto out;
+		nr++;
+	}
+	if (nr != packed.nr_entries)
+		goto out;
+
+	/* Neither the big value nor the pointer fit in a packed leaf */
+	xa_store(&xa, 16, xa_mk_value(XA_PACKED_MAX + 1));
+	xa_store(&xa, 33, &xa);
+	if (xa_load(&xa, 16) != xa_mk_value(XA_PACKED_MAX + 1) ||
+	    xa_load(&xa, 33) != &xa || xa_load(&xa, 17) != packed_entry(17) ||
+	    xa_get_order(&xa, 18))
+		goto out;
+
+	for (index = 0; index < 4096; index++)
+		xa_erase(&xa, index);
+
+	xa_get_account(&xa, &packed);
+	if (packed.nr_entries || packed.nr_nodes || packed.node_bytes)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "packed:           %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	xa_destroy(&ref);
+	return ret;
+}
+
+/* Every other index below 1024, and a uniform range above */
+static void *flags_entry(unsigned long index)
+{
+	if (index < 1024)
+		return index % 2 ? NULL : xa_mk_value(index);
+
+	return index >= 4096 && index < 4352 ? xa_mk_value(1) : NULL;
+}
+
+/* The loads, the iteration and the marks with each of the engines */
+static bool test_flags(void)
+{
+	static const unsigned long flags[] = {
+		0, XA_FLAGS_INLINE, XA_FLAGS_COMPRESS, XA_FLAGS_ADAPTIVE,
+		XA_FLAGS_COALESCE, XA_FLAGS_COUNT,
+		XA_FLAGS_INLINE | XA_FLAGS_COMPRESS | XA_FLAGS_COUNT,
+		XA_FLAGS_PACKED, XA_FLAGS_INLINE | XA_FLAGS_PACKED,
+	};
+	struct xarray xa;
+	unsigned long i, index, nr;
+	bool ret = true, marks;
+	void *entry;
+
+	for (i = 0; ret && i < sizeof(flags) / sizeof(flags[0]); i++) {
+		/* The adaptive and packed arrays have no marks */
+		marks = !(flags[i] & (XA_FLAGS_ADAPTIVE | XA_FLAGS_PACKED));
+		xa_init_flags(&xa, flags[i]);
+		ret = false;
+
+		for (index = 0; index < 8192; index++) {
+			entry = flags_entry(index);
+			if (entry)
+				xa_store(&xa, index, entry);
+		}
+		for (index = 0; marks && index < 1024; index += 6)
+			xa_set_mark(&xa, index, XA_MARK_1);
+
+		for (index = 0; index < 8192; index++) {
+			if (xa_load(&xa, index) != flags_entry(index))
+				goto out;
+			if (marks && xa_get_mark(&xa, index, XA_MARK_1) !=
+			    (index < 1024 && !(index % 6)))
+				goto out;
+		}
+
+		/* Visit the entries below the uniform range in order */
+		nr = 0;
+		index = 0;
+		for (entry = xa_find(&xa, &index, 1023, XA_PRESENT); entry;
+		     entry = xa_find_after(&xa, &index, 1023, XA_PRESENT)) {
+			if (index != nr * 2 || entry != flags_entry(index))
+				goto out;
+			nr++;
+		}
+		if (nr != 512)
+			goto out;
+
+		nr = 0;
+		index = 0;
+		entry = marks ? xa_find(&xa, &index, ~0UL, XA_MARK_1) : NULL;
+		while (entry) {
+			if (index != nr * 6)
+				goto out;
+			nr++;
+			entry = xa_find_after(&xa, &index, ~0UL, XA_MARK_1);
+		}
+		if ((marks && nr != 171) ||
+		    xa_count_range(&xa, 0, ~0UL) != 512 + 256)
+			goto out;
+
+		/* Erasing splits the uniform range */
+		xa_erase(&xa, 4100);
+		if (marks)
+			xa_clear_mark(&xa, 6, XA_MARK_1);
+		if (xa_load(&xa, 4100) ||
+		    xa_load(&xa, 4101) != xa_mk_value(1) ||
+		    (marks && xa_get_mark(&xa, 6, XA_MARK_1)) ||
+		    xa_count_range(&xa, 4096, 4351) != 255)
+			goto out;
+
+		ret = true;
+out:
+		if (!ret)
+			fprintf(stdout, "flags 0x%lx at %lu\n",
+				flags[i], index);
+		xa_destroy(&xa);
+	}
+
+	fprintf(stdout, "flags:            %s\n", ret ? "passed" : "failed");
+	return ret;
+}
+
+/* The marks of @index, which is matched against the expressions */
+static unsigned int marks_of(unsigned long index)
+{
+	return (index % 2 ? 1 : 0) | (index % 3 ? 0 : 2) | (index % 5 ? 0 : 4);
+}
+
+static bool test_mark_expr(void)
+{
+	static const xa_marks_t exprs[] = {
+		XA_MARKS(XA_MARK_0) & ~XA_MARKS(XA_MARK_1),
+		XA_MARKS(XA_MARK_1) | XA_MARKS(XA_MARK_2),
+		XA_MARKS(XA_MARK_0) & XA_MARKS(XA_MARK_1) & XA_MARKS(XA_MARK_2),
+		~(XA_MARKS(XA_MARK_0) | XA_MARKS(XA_MARK_1) |
+		  XA_MARKS(XA_MARK_2)),
+	};
+	struct xarray xa;
+	unsigned long i, index, next;
+	unsigned int mark;
+	bool ret = false;
+	void *entry;
+
+	xa_init(&xa);
+	for (index = 0; index < 2048; index += 2) {
+		xa_store(&xa, index * 3 + 1, xa_mk_value(index));
+		for (mark = 0; mark <= 2; mark++) {
+			if (marks_of(index) & (1U << mark))
+				xa_set_mark(&xa, index * 3 + 1,
+					    (__force xa_mark_t)mark);
+		}
+	}
+
+	for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+		/* The first matching index at or after @next */
+		next = 0;
+		index = 0;
+		for (entry = xa_find_marks(&xa, &index, ~0UL, exprs[i]); entry;
+		     entry = xa_find_marks_after(&xa, &index, ~0UL, exprs[i])) {
+			while (next < 2048 &&
+			       !(exprs[i] & (1U << marks_of(next))))
+				next += 2;
+			if (next >= 2048 || index != next * 3 + 1 ||
+			    entry != xa_mk_value(next))
+				goto out;
+			next += 2;
+		}
+		while (next < 2048 && !(exprs[i] & (1U << marks_of(next))))
+			next += 2;
+		if (next < 2048)
+			goto out;
+	}
+
+	ret = true;
+out:
+	fprintf(stdout, "mark expression:  %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+static bool test_mark_range(void)
+{
+	struct xarray xa;
+	unsigned long index;
+	bool ret = false, present, marked;
+
+	xa_init(&xa);
+	for (index = 0; index < 65536; index += 7)
+		xa_store(&xa, index, xa_mk_value(index));
+
+	xa_set_mark_range(&xa, 100, 50000, XA_MARK_2);
+	xa_clear_mark_range(&xa, 300, 400, XA_MARK_2);
+	xa_tag_marked_range(&xa, 0, 20000, XA_MARK_2, XA_MARK_0);
+
+	for (index = 0; index < 65536; index++) {
+		present = !(index % 7);
+		marked = present && index >= 100 && index <= 50000 &&
+			 (index < 300 || index > 400);
+
+		if (xa_get_mark(&xa, index, XA_MARK_2) != marked ||
+		    xa_get_mark(&xa, index, XA_MARK_0) !=
+		    (marked && index <= 20000))
+			goto out;
+	}
+
+	ret = true;
+out:
+	fprintf(stdout, "mark range:       %s\n", ret ? "passed" : "failed");
+	xa_destroy(&xa);
+	return ret;
+}
+
+static bool test_ida(void)
+{
+	struct ida ida;
+	unsigned int id;
+	bool ret = false;
+
+	ida_init(&ida);
+	for (id = 0; id < 3000; id++) {
+		if (ida_alloc(&ida) != id)
+			goto out;
+	}
+
+	ida_free(&ida, 5);
+	ida_free(&ida, 2500);
+	ida_free(&ida, 5);		/* Not allocated */
+	ida_free(&ida, 100000);
+	if (ida_exists(&ida, 5) || !ida_exists(&ida, 6) ||
+	    ida_exists(&ida, 3000))
+		goto out;
+
+	if (ida_alloc(&ida) != 5 || ida_alloc(&ida) != 2500 ||
+	    ida_alloc(&ida) != 3000 || ida_alloc_min(&ida, 70000) != 70000 ||
+	    ida_alloc_range(&ida, 10, 20) != -ENOSPC)
+		goto out;
+
+	for (id = 0; id <= 3000; id++)
+		ida_free(&ida, id);
+	ida_free(&ida, 70000);
+	if (!ida_is_empty(&ida))
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "ida:              %s\n", ret ? "passed" : "failed");
+	ida_destroy(&ida);
+	return ret;
+}
+
+/* The array built from the sorted entries is the one built by the stores */
+static bool test_build_sorted(void)
+{
+	static const unsigned long flags[] = {
+		0, XA_FLAGS_COMPRESS, XA_FLAGS_COALESCE, XA_FLAGS_COUNT,
+		XA_FLAGS_INLINE,
+	};
+	const unsigned long nr = 20000;
+	unsigned long *indexes = malloc(nr * sizeof(*indexes));
+	void **entries = malloc(nr * sizeof(*entries));
+	struct xarray xa, ref;
+	unsigned long i, index = 0;
+	bool ret = false;
+
+	if (!indexes || !entries)
+		goto out;
+
+	/* Dense runs and sparse gaps, and a uniform run to be coalesced */
+	for (i = 0; i < nr; i++) {
+		index += (i / 1000) % 2 ? 1 + i * 37 % 5000 : 1;
+		indexes[i] = index;
+		entries[i] = xa_mk_value(i >= 4096 && i < 8192 ? 1 : i);
+	}
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		unsigned long j;
+		bool same = true;
+
+		xa_init_flags(&xa, flags[i]);
+		xa_init_flags(&ref, flags[i]);
+		if (xa_build_sorted(&xa, indexes, entries, nr, 2))
+			same = false;
+		for (j = 0; same && j < nr; j++)
+			xa_store(&ref, indexes[j], entries[j]);
+
+		for (j = 0; same && j < nr; j++) {
+			if (xa_load(&xa, indexes[j]) != entries[j] ||
+			    xa_load(&xa, indexes[j] + 1) !=
+			    xa_load(&ref, indexes[j] + 1))
+				same = false;
+		}
+		if (same && (xa_count_range(&xa, 0, ~0UL) != nr ||
+			     xa_build_sorted(&xa, indexes, entries, nr, 1) !=
+			     -EBUSY))
+			same = false;
+
+		xa_destroy(&xa);
+		xa_destroy(&ref);
+		if (!same)
+			goto out;
+	}
+
+	/* The indexes out of order */
+	xa_init(&xa);
+	index = indexes[1];
+	indexes[1] = indexes[0];
+	indexes[0] = index;
+	i = xa_build_sorted(&xa, indexes, entries, nr, 1) == -EINVAL &&
+	    !xa_head(&xa);
+	xa_destroy(&xa);
+	if (!i)
+		goto out;
+
+	ret = true;
+out:
+	fprintf(stdout, "build sorted:     %s\n", ret ? "passed" : "failed");
+	free(indexes);
+	free(entries);
+	return ret;
+}
+
+bool test_lib_xarray(void)
+{
+	bool ret = true;
 	struct xarray xa;
 	void *value = (void *)0x00ffff00;
 
@@ -125,6 +1126,24 @@ void test_lib_xarray(void)
 	xa_erase(&xa, 16);
 	dump(&xa);
 
+	ret &= test_checkpoint();
+	ret &= test_checkpoint_coalesce();
+	ret &= test_count_coalesce();
+	ret &= test_count_modes();
+	ret &= test_budget();
+	ret &= test_stats();
+	ret &= test_lock_stats();
+	ret &= test_record();
+	ret &= test_hint();
+	ret &= test_compact();
+	ret &= test_regions();
+	ret &= test_flags();
+	ret &= test_packed();
+	ret &= test_mark_expr();
+	ret &= test_mark_range();
+	ret &= test_ida();
+	ret &= test_build_sorted();
+
 	// add_entry(&xa, 0x000, 9, (void *)&values[0]);
 	// add_entry(&xa, 0x200, 9, (void *)&values[1]);
 	// dump(&xa);
@@ -133,4 +1152,7 @@ void test_lib_xarray(void)
 	// split_and_add_entry(&xa, 0x200, 1, (void *)&values[2]);
 	// split_and_add_entry(&xa, 0x200, 0, (void *)&values[2]);
 	// dump(&xa);
+
+	xa_destroy(&xa);
+	return ret;
 }
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Merge the file-backed trace rings by timestamp and print the records.
+ *
+ * Usage: trace-dump <ring file>...
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <mbox/trace.h>
+
+static struct trace_ring *map_ring(const char *path)
+{
+	struct trace_ring *ring;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (ring->magic != TRACE_RING_MAGIC) {
+		fprintf(stderr, "%s: Not a trace ring\n", path);
+		munmap(ring, sizeof(*ring));
+		return NULL;
+	}
+
+	return ring;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_ring **rings;
+	int i, nr = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <ring file>...\n", argv[0]);
+		return 1;
+	}
+
+	rings = calloc(argc - 1, sizeof(*rings));
+	if (!rings)
+		return 1;
+
+	for (i = 1; i < argc; i++) {
+		rings[nr] = map_ring(argv[i]);
+		if (rings[nr])
+			nr++;
+	}
+
+	return trace_merge(rings, nr, stdout) ? 1 : 0;
+}
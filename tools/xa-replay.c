@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Replay the calls recorded by xa_record_start() against a new array.
+ * The calls are replayed in the recorded order by default, which is
+ * deterministic. With -t, every recorded thread replays its own calls
+ * in a thread of its own, racing with the others as they did.
+ *
+ * Usage: xa-replay [-t] [-n loops] <record file>
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <mbox/timestamp.h>
+#include <mbox/xarray.h>
+
+struct replay_thread {
+	pthread_t		thread;
+	struct xarray		*xa;
+	unsigned long		nr;
+	struct xa_record	**records;
+};
+
+static pthread_barrier_t replay_barrier;
+
+static void *replay_entry(const struct xa_record *r)
+{
+	if (r->entry == XA_RECORD_POINTER)
+		return xa_mk_value(r->index & LONG_MAX);
+
+	return (void *)(unsigned long)r->entry;
+}
+
+static void replay_one(struct xarray *xa, const struct xa_record *r)
+{
+	unsigned long index = r->index;
+	xa_mark_t mark = (__force xa_mark_t)r->mark;
+
+	switch (r->op) {
+	case XA_OP_LOAD:
+		xa_load(xa, index);
+		break;
+	case XA_OP_STORE:
+		xa_store(xa, index, replay_entry(r));
+		break;
+	case XA_OP_STORE_RANGE:
+		xa_store_range(xa, index, r->last, replay_entry(r));
+		break;
+	case XA_OP_ERASE:
+		xa_erase(xa, index);
+		break;
+	case XA_OP_FIND:
+		xa_find(xa, &index, r->last, mark);
+		break;
+	case XA_OP_FIND_AFTER:
+		xa_find_after(xa, &index, r->last, mark);
+		break;
+	case XA_OP_GET_MARK:
+		xa_get_mark(xa, index, mark);
+		break;
+	case XA_OP_SET_MARK:
+		xa_set_mark(xa, index, mark);
+		break;
+	case XA_OP_CLEAR_MARK:
+		xa_clear_mark(xa, index, mark);
+		break;
+	}
+}
+
+static void *replay_thread_fn(void *arg)
+{
+	struct replay_thread *t = arg;
+	unsigned long i;
+
+	pthread_barrier_wait(&replay_barrier);
+
+	for (i = 0; i < t->nr; i++)
+		replay_one(t->xa, t->records[i]);
+
+	return NULL;
+}
+
+static int replay_threads(struct xarray *xa, struct xa_record *records,
+			  unsigned long nr)
+{
+	struct replay_thread *threads;
+	unsigned int nr_threads = 0, i;
+	unsigned long j;
+	int ret = -ENOMEM;
+
+	if (!nr)
+		return 0;
+
+	for (j = 0; j < nr; j++) {
+		if (records[j].tid >= nr_threads)
+			nr_threads = records[j].tid + 1;
+	}
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	for (j = 0; j < nr; j++)
+		threads[records[j].tid].nr++;
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].xa = xa;
+		threads[i].records = malloc((threads[i].nr ? : 1) *
+					    sizeof(*threads[i].records));
+		if (!threads[i].records)
+			goto out;
+
+		threads[i].nr = 0;
+	}
+
+	for (j = 0; j < nr; j++) {
+		i = records[j].tid;
+		threads[i].records[threads[i].nr++] = &records[j];
+	}
+
+	pthread_barrier_init(&replay_barrier, NULL, nr_threads);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i].thread, NULL,
+			       replay_thread_fn, &threads[i]);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	pthread_barrier_destroy(&replay_barrier);
+	ret = 0;
+out:
+	for (i = 0; i < nr_threads; i++)
+		free(threads[i].records);
+	free(threads);
+	return ret;
+}
+
+static struct xa_record *load_records(const char *path, unsigned long *nr,
+				      unsigned int *flags)
+{
+	struct xa_record_header header;
+	struct xa_record *records = NULL, *tmp;
+	unsigned long size = 0;
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != XA_RECORD_MAGIC ||
+	    header.version != XA_RECORD_VERSION ||
+	    header.size != sizeof(*records)) {
+		fprintf(stderr, "%s: Not a record file\n", path);
+		goto out;
+	}
+
+	*nr = 0;
+	*flags = header.flags;
+	for (;;) {
+		if (*nr == size) {
+			size = size ? size * 2 : 4096;
+			tmp = realloc(records, size * sizeof(*records));
+			if (!tmp) {
+				free(records);
+				records = NULL;
+				break;
+			}
+
+			records = tmp;
+		}
+
+		if (fread(&records[*nr], sizeof(*records), 1, fp) != 1)
+			break;
+
+		(*nr)++;
+	}
+
+out:
+	fclose(fp);
+	return records;
+}
+
+int main(int argc, char **argv)
+{
+	struct xa_record *records;
+	struct xa_account account;
+	struct xarray xa;
+	unsigned long nr, i, loops = 1, loop;
+	unsigned int flags;
+	bool threaded = false;
+	u64 start, elapsed = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "tn:")) != -1) {
+		switch (opt) {
+		case 't':
+			threaded = true;
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0) ? : 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 1)
+		goto usage;
+
+	records = load_records(argv[optind], &nr, &flags);
+	if (!records)
+		return 1;
+
+	for (loop = 0; loop < loops && !ret; loop++) {
+		xa_init_flags(&xa, flags | XA_FLAGS_ACCOUNT);
+
+		start = timestamp_ordered();
+		if (threaded) {
+			ret = replay_threads(&xa, records, nr);
+		} else {
+			for (i = 0; i < nr; i++)
+				replay_one(&xa, &records[i]);
+		}
+		elapsed += timestamp_ordered() - start;
+
+		xa_get_account(&xa, &account);
+		xa_destroy(&xa);
+	}
+
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		free(records);
+		return 1;
+	}
+
+	elapsed = timestamp_to_ns(elapsed);
+	fprintf(stdout, "{\"records\": %lu, \"loops\": %lu, \"threaded\": %s, "
+		"\"ns\": %llu, \"ns_per_op\": %.2f, \"entries\": %lu, "
+		"\"nodes\": %lu}\n", nr, loops, threaded ? "true" : "false",
+		(unsigned long long)elapsed,
+		nr ? (double)elapsed / (nr * loops) : 0,
+		account.nr_entries, account.nr_nodes);
+
+	free(records);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-t] [-n loops] <record file>\n", argv[0]);
+	return 1;
+}